@@ -3,6 +3,9 @@
 
 #include "kvfifo.h"
 #include <cassert>
+#include <cstdlib>
+#include <list>
+#include <new>
 #include <string>
 #include <iostream>
 #include <vector>
@@ -75,6 +78,33 @@ void operator delete[](void* m, size_t sz)
     free(m);
 }
 
+// Wersje dla typów wyrównanych ponad max_align_t też liczymy.
+void* operator new(size_t sz, std::align_val_t al)
+{
+    if (is_counting) {
+        counter++;
+        if (counter == mem_fail) {
+            did_fail = true;
+            throw std::bad_alloc();
+        }
+    }
+
+    size_t align = static_cast<size_t>(al);
+    void* m = aligned_alloc(align, (sz + align - 1) / align * align);
+
+    return m;
+}
+
+void operator delete(void* m, std::align_val_t al)
+{
+    free(m);
+}
+
+void operator delete(void* m, size_t sz, std::align_val_t al)
+{
+    free(m);
+}
+
 namespace mkostyk {
     int const SEED = 110912309;
     // int const SEED = time(NULL); - Jeśli chcesz żeby był test losowy.
@@ -210,10 +240,198 @@ namespace mkostyk {
         }
     }
 
+    // Puste kolejki, ich kopie i obiekty po przeniesieniu nie powinny alokować.
+    void no_alloc_test() {
+        cout << "No alloc test" << endl;
+        kvfifo <string, int> filled;
+        filled.push("key", 1);
+
+        counter = 0;
+        mem_fail = 0;
+        enable_counting();
+        {
+            kvfifo <string, int> empty;
+            kvfifo <string, int> empty_copy = empty;
+            kvfifo <string, int> shared = filled;
+            shared.clear();
+            kvfifo <string, int> moved = std::move(empty_copy);
+            empty = {};
+            assert(empty.empty() && moved.empty() && shared.empty() && empty_copy.empty());
+        }
+        disable_counting();
+
+        assert(counter == 0);
+        assert(filled.size() == 1);
+    }
+
+    // Gdy tyle samo wkładamy, co zdejmujemy, węzły wracają z puli kontenera.
+    void recycle_test() {
+        cout << "Recycle test" << endl;
+        kvfifo <int, int> churn;
+        auto step = [&churn](int i) {
+            churn.push(i % 4, i);
+            churn.pop();
+            churn.push(i % 4, i);
+            churn.pop(i % 4);
+        };
+        for (int i = 0; i < 8; i++) {
+            churn.push(i % 4, i);
+        }
+        step(0);
+
+        counter = 0;
+        mem_fail = 0;
+        enable_counting();
+        for (int i = 0; i < 1000; i++) {
+            step(i);
+        }
+        churn.clear();
+        for (int i = 0; i < 8; i++) {
+            churn.push(i % 4, i);
+        }
+        disable_counting();
+
+        // Wpisy indeksu dla kluczy dodanych po clear() też wracają z puli.
+        assert(counter == 0);
+        assert(churn.size() == 8);
+
+        assert(churn.memory_usage().cached > 0);
+        churn.shrink_to_fit();
+        assert(churn.memory_usage().cached == 0);
+        churn.pop();
+        assert(churn.memory_usage().cached > 0);
+        churn.shrink_to_fit();
+        assert(churn.memory_usage().cached == 0);
+    }
+
+    // Po reserve() push() nie alokuje, a kolejne elementy leżą obok siebie.
+    template <typename Q>
+    void reserve_queue_test() {
+        Q reserved;
+        reserved.reserve(1000, 4);
+
+        counter = 0;
+        mem_fail = 0;
+        enable_counting();
+        for (int i = 0; i < 1000; i++) {
+            reserved.push(i % 4, i);
+        }
+        disable_counting();
+        assert(counter == 0);
+        assert(reserved.size() == 1000 && reserved.count(3) == 250);
+
+        Q const &cref = reserved;
+        auto const *first = &cref.front().second;
+        reserved.pop();
+        auto const *second = &cref.front().second;
+        reserved.pop();
+        assert(&cref.front().second - second == second - first && second > first);
+    }
+
+    struct alignas(32) wide_value {
+        int value;
+        wide_value(int value) : value(value) {}
+    };
+
+    size_t last_node_size = 0;
+
+    // Zapamiętuje rozmiar węzła, który alokuje std::list.
+    template <typename T>
+    struct node_size_allocator {
+        using value_type = T;
+
+        node_size_allocator() = default;
+        template <typename U>
+        node_size_allocator(node_size_allocator<U> const &) {}
+
+        T* allocate(size_t n) {
+            last_node_size = sizeof(T);
+            return std::allocator<T>().allocate(n);
+        }
+
+        void deallocate(T* p, size_t n) {
+            std::allocator<T>().deallocate(p, n);
+        }
+
+        template <typename U>
+        bool operator==(node_size_allocator<U> const &) const { return true; }
+    };
+
+    // reserve() rezerwuje bloki rozmiaru node_bytes(2), więc musi on być rozmiarem węzła listy.
+    template <typename T>
+    void check_node_bytes(T const &value) {
+        std::list<T, node_size_allocator<T>> list;
+        list.push_back(value);
+        assert(last_node_size == kvfifo_detail::node_bytes<T>(2));
+    }
+
+    void reserve_test() {
+        cout << "Reserve test" << endl;
+        check_node_bytes('c');
+        check_node_bytes(1);
+        check_node_bytes(std::pair<int const, int>(1, 1));
+        check_node_bytes(std::pair<int const, wide_value>(1, 1));
+        check_node_bytes(string("node"));
+
+        reserve_queue_test<basic_kvfifo <int, int, kvfifo_policy::sorted_vector_index>>();
+        reserve_queue_test<basic_kvfifo <int, int, kvfifo_policy::dense_index<0, 3>>>();
+        reserve_queue_test<basic_kvfifo <int, int, kvfifo_policy::small_index<4>>>();
+        reserve_queue_test<basic_kvfifo <int, wide_value, kvfifo_policy::sorted_vector_index>>();
+
+        // Kopia zarezerwowanej kolejki i części po partition_by() przeżywają oryginał.
+        kvfifo <int, int> *original = new kvfifo <int, int>();
+        original->reserve(100);
+        for (int i = 0; i < 100; i++) {
+            original->push(i % 10, i);
+        }
+        kvfifo <int, int> copy = *original;
+        auto parts = original->partition_by(2, [](int k) { return std::size_t(k % 2); });
+        delete original;
+        assert(copy.size() == 100 && parts[0].size() == 50 && parts[1].size() == 50);
+        for (int i = 0; i < 50; i++) {
+            parts[0].pop();
+        }
+        for (int i = 0; i < 10; i++) {
+            parts[1].pop(1);
+        }
+        parts[0].shrink_to_fit();
+        assert(parts[0].empty() && parts[1].count(1) == 0 && parts[1].size() == 40);
+    }
+
+    // partition_by() kolejki pmr bierze pamięć z jej zasobu; ze sterty tylko wektor wyniku.
+    template <typename Q>
+    void pmr_partition_queue_test() {
+        std::byte buffer[1 << 15];
+        std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+        Q kvf(&arena);
+        for (int i = 0; i < 100; i++) {
+            kvf.push(i % 7, i);
+        }
+
+        counter = 0;
+        mem_fail = 0;
+        enable_counting();
+        auto parts = kvf.partition_by(3, [](int k) { return std::size_t(k % 3); });
+        disable_counting();
+        assert(counter == 1);
+        assert(kvf.empty() && parts[0].size() == 43 && parts[1].count(4) == 14);
+    }
+
+    void pmr_partition_test() {
+        cout << "Pmr partition test" << endl;
+        pmr_partition_queue_test<pmr_kvfifo <int, int>>();
+        pmr_partition_queue_test<pmr_kvfifo <int, int, kvfifo_policy::hashed_index>>();
+        pmr_partition_queue_test<pmr_kvfifo <int, int, kvfifo_policy::sorted_vector_index>>();
+    }
+
     void mkostyk_alloc_fail_main() {
         srand(SEED);
         vector <int> ops;
         cout << WHITE << "---------- ALLOC FAIL TEST ----------" << RESET << endl;
+        no_alloc_test();
+        recycle_test();
+        reserve_test();
+        pmr_partition_test();
         for (int i = 0; i < TEST_SIZE; i++) {
             // Test jest domyślnie deterministyczny, ponieważ seed jest ustalony.
             // "Losowanie" w tej funkcji służy tylko do generowania operacji.
@@ -0,0 +1,212 @@
+#ifndef ASYNC_KVFIFO_H
+#define ASYNC_KVFIFO_H
+
+#include "kvfifo.h"
+#include "kvfifo_waiters.h"
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <utility>
+
+/**
+ * Jednowątkowy wykonawca: kolejka korutyn gotowych do wznowienia. Nikt nie
+ * wznawia korutyn poza run(), więc czekający konsumenci nie zużywają czasu
+ * procesora, a producent nigdy nie wykonuje kodu konsumenta.
+ */
+class kvfifo_executor {
+public:
+    void post(std::coroutine_handle<> coro) {
+        ready.push_back(coro);
+    }
+
+    // Wznawia korutyny, aż żadna nie będzie gotowa; zwraca liczbę wznowień.
+    std::size_t run() {
+        std::size_t resumed = 0;
+
+        while (!ready.empty()) {
+            std::coroutine_handle<> coro = ready.front();
+            ready.pop_front();
+            coro.resume();
+            resumed++;
+        }
+
+        return resumed;
+    }
+
+    bool idle() const noexcept {
+        return ready.empty();
+    }
+
+private:
+    std::deque<std::coroutine_handle<>> ready;
+};
+
+/**
+ * Korutyna-konsument. Zaczyna się dopiero po start() i sama się niszczy po
+ * zakończeniu; wyjątek, który z niej wyjdzie, kończy program.
+ */
+class kvfifo_task {
+public:
+    struct promise_type {
+        kvfifo_task get_return_object() noexcept {
+            return kvfifo_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    kvfifo_task(kvfifo_task &&other) noexcept : coro(std::exchange(other.coro, nullptr)) {}
+
+    kvfifo_task &operator=(kvfifo_task &&) = delete;
+
+    // Nieuruchomiona korutyna jest niszczona razem z obiektem.
+    ~kvfifo_task() noexcept {
+        if (coro) {
+            coro.destroy();
+        }
+    }
+
+    void start(kvfifo_executor &executor) && {
+        executor.post(coro);
+        coro = nullptr;
+    }
+
+private:
+    explicit kvfifo_task(std::coroutine_handle<promise_type> coro) : coro(coro) {}
+
+    std::coroutine_handle<promise_type> coro;
+};
+
+/**
+ * Kolejka basic_kvfifo z operacjami co_await pop_async() i co_await
+ * pop_async(k), które czekają na element (o danym kluczu). push() oddaje
+ * element bezpośrednio najdłużej czekającemu pasującemu konsumentowi
+ * i przekazuje go wykonawcy do wznowienia. Obiekt nie jest bezpieczny dla
+ * wątków - wszyscy producenci i konsumenci działają w wątku wykonawcy.
+ */
+template<typename K, typename V, typename... Policies>
+class async_kvfifo {
+    class waiter_t;
+    using registry_t = kvfifo_detail::waiter_registry<K, waiter_t, Policies...>;
+
+public:
+    using queue_type = basic_kvfifo<K, V, Policies...>;
+
+    explicit async_kvfifo(kvfifo_executor &executor) : executor(executor) {}
+
+    async_kvfifo(async_kvfifo const &) = delete;
+    async_kvfifo &operator=(async_kvfifo const &) = delete;
+
+    void push(K const &k, V const &v) {
+        waiter_t *waiter = waiters.first(k);
+
+        if (waiter == nullptr) {
+            queue.push(k, v);
+            return;
+        }
+
+        waiter->result.emplace(k, v);
+
+        try {
+            executor.post(waiter->coro);
+        } catch (...) {
+            waiter->result.reset();
+            throw;
+        }
+
+        waiters.unregister(waiter);
+    }
+
+    // Zwraca std::pair<K, V> po co_await.
+    [[nodiscard]] waiter_t pop_async() {
+        return waiter_t(this, std::nullopt);
+    }
+
+    [[nodiscard]] waiter_t pop_async(K const &k) {
+        return waiter_t(this, k);
+    }
+
+    std::size_t size() const noexcept {
+        return queue.size();
+    }
+
+    bool empty() const noexcept {
+        return queue.empty();
+    }
+
+    std::size_t count(K const &k) const {
+        return queue.count(k);
+    }
+
+    // Liczba wstrzymanych konsumentów.
+    std::size_t waiting() const noexcept {
+        return waiters.size();
+    }
+
+private:
+    class waiter_t {
+    public:
+        waiter_t(waiter_t const &) = delete;
+        waiter_t &operator=(waiter_t const &) = delete;
+
+        // Korutyna zniszczona w trakcie czekania przestaje czekać.
+        ~waiter_t() noexcept {
+            if (registered) {
+                owner->waiters.unregister(this);
+            }
+        }
+
+        bool await_ready() {
+            queue_type const &queue = owner->queue;
+
+            if (key.has_value() ? queue.count(*key) == 0 : queue.empty()) {
+                return false;
+            }
+
+            auto elem = key.has_value() ? queue.first(*key) : queue.front();
+            result.emplace(elem.first, elem.second);
+
+            if (key.has_value()) {
+                owner->queue.pop(*key);
+            } else {
+                owner->queue.pop();
+            }
+
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> awaiting) {
+            coro = awaiting;
+            owner->waiters.enlist(this);
+        }
+
+        std::pair<K, V> await_resume() {
+            return std::move(*result);
+        }
+
+    private:
+        friend class async_kvfifo;
+        friend registry_t;
+
+        waiter_t(async_kvfifo *owner, std::optional<K> key) : owner(owner), key(std::move(key)) {}
+
+        async_kvfifo *owner;
+        std::optional<K> key;
+        std::optional<std::pair<K, V>> result;
+        std::coroutine_handle<> coro;
+        std::uint64_t seq = 0;
+        typename registry_t::list_type::iterator position;
+        bool registered = false;
+    };
+
+    kvfifo_executor &executor;
+    queue_type queue;
+    registry_t waiters;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef BLOCKING_KVFIFO_H
+#define BLOCKING_KVFIFO_H
+
+#include "kvfifo.h"
+#include "kvfifo_waiters.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+/**
+ * Kolejka basic_kvfifo dla wielu wątków, z blokującym wait_pop() i wait_pop(k)
+ * oraz wersjami z limitem czasu. push() oddaje element bezpośrednio
+ * najdłużej czekającemu pasującemu wątkowi i budzi tylko jego - wątki
+ * czekające na inne klucze nie są budzone.
+ */
+template<typename K, typename V, typename... Policies>
+class blocking_kvfifo {
+    struct waiter_t;
+    using registry_t = kvfifo_detail::waiter_registry<K, waiter_t, Policies...>;
+
+public:
+    using queue_type = basic_kvfifo<K, V, Policies...>;
+
+    blocking_kvfifo() = default;
+
+    blocking_kvfifo(blocking_kvfifo const &) = delete;
+    blocking_kvfifo &operator=(blocking_kvfifo const &) = delete;
+
+    void push(K const &k, V const &v) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        waiter_t *waiter = waiters.first(k);
+
+        if (waiter == nullptr) {
+            queue.push(k, v);
+            return;
+        }
+
+        waiter->result.emplace(k, v);
+        waiters.unregister(waiter);
+        waiter->ready.notify_one();
+    }
+
+    std::pair<K, V> wait_pop() {
+        return *pop_with(std::nullopt, [](std::unique_lock<std::mutex> &lock, waiter_t &waiter) {
+            waiter.ready.wait(lock, [&waiter]() { return waiter.result.has_value(); });
+        });
+    }
+
+    std::pair<K, V> wait_pop(K const &k) {
+        return *pop_with(k, [](std::unique_lock<std::mutex> &lock, waiter_t &waiter) {
+            waiter.ready.wait(lock, [&waiter]() { return waiter.result.has_value(); });
+        });
+    }
+
+    // Pusty wynik, jeśli do deadline nie pojawił się żaden element.
+    template<typename Clock, typename Duration>
+    std::optional<std::pair<K, V>> wait_pop_until(std::chrono::time_point<Clock, Duration> const &deadline) {
+        return pop_with(std::nullopt, until(deadline));
+    }
+
+    template<typename Clock, typename Duration>
+    std::optional<std::pair<K, V>> wait_pop_until(K const &k,
+                                                  std::chrono::time_point<Clock, Duration> const &deadline) {
+        return pop_with(k, until(deadline));
+    }
+
+    template<typename Rep, typename Period>
+    std::optional<std::pair<K, V>> wait_pop_for(std::chrono::duration<Rep, Period> const &timeout) {
+        return wait_pop_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Rep, typename Period>
+    std::optional<std::pair<K, V>> wait_pop_for(K const &k, std::chrono::duration<Rep, Period> const &timeout) {
+        return wait_pop_until(k, std::chrono::steady_clock::now() + timeout);
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.size();
+    }
+
+    bool empty() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.empty();
+    }
+
+    std::size_t count(K const &k) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queue.count(k);
+    }
+
+    // Liczba wątków czekających w wait_pop().
+    std::size_t waiting() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return waiters.size();
+    }
+
+private:
+    struct waiter_t {
+        std::optional<K> key;
+        std::optional<std::pair<K, V>> result;
+        std::condition_variable ready;
+        std::uint64_t seq = 0;
+        typename registry_t::list_type::iterator position;
+        bool registered = false;
+    };
+
+    template<typename Clock, typename Duration>
+    static auto until(std::chrono::time_point<Clock, Duration> const &deadline) {
+        return [&deadline](std::unique_lock<std::mutex> &lock, waiter_t &waiter) {
+            waiter.ready.wait_until(lock, deadline, [&waiter]() { return waiter.result.has_value(); });
+        };
+    }
+
+    // Bierze pasujący element prosto z kolejki, jeśli jest.
+    bool take(waiter_t &waiter) {
+        queue_type const &cqueue = queue;
+
+        if (waiter.key.has_value() ? cqueue.count(*waiter.key) == 0 : cqueue.empty()) {
+            return false;
+        }
+
+        auto elem = waiter.key.has_value() ? cqueue.first(*waiter.key) : cqueue.front();
+        waiter.result.emplace(elem.first, elem.second);
+
+        if (waiter.key.has_value()) {
+            queue.pop(*waiter.key);
+        } else {
+            queue.pop();
+        }
+
+        return true;
+    }
+
+    /**
+     * Wspólna część wait_pop*: wait(lock, waiter) czeka, aż push() przekaże
+     * element albo minie czas; waiter jest wypisywany z rejestru w każdym
+     * przypadku, także przy wyjątku.
+     */
+    template<typename Wait>
+    std::optional<std::pair<K, V>> pop_with(std::optional<K> key, Wait &&wait) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        waiter_t waiter;
+        waiter.key = std::move(key);
+
+        if (!take(waiter)) {
+            waiters.enlist(&waiter);
+
+            try {
+                wait(lock, waiter);
+            } catch (...) {
+                if (waiter.registered) {
+                    waiters.unregister(&waiter);
+                }
+
+                throw;
+            }
+
+            if (waiter.registered) {
+                waiters.unregister(&waiter);
+            }
+        }
+
+        return std::move(waiter.result);
+    }
+
+    mutable std::mutex mutex;
+    queue_type queue;
+    registry_t waiters;
+};
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef EPOCH_KVFIFO_H
+#define EPOCH_KVFIFO_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * Kolejka o interfejsie kvfifo, w której move_to_back(k) kosztuje O(log K)
+ * niezależnie od liczby elementów klucza. Elementy nie tworzą jednej listy:
+ * każdy klucz trzyma swoje elementy w kolejności wstawienia, element
+ * pamięta chwilę wstawienia p, a klucz chwilę ostatniego move_to_back m.
+ * Pozycją elementu w kolejce jest para (max(p, m), p) - move_to_back tylko
+ * podbija m, a globalną kolejność wyznaczamy leniwie, trzymając pozycje
+ * pierwszych i ostatnich elementów wszystkich kluczy w drzewach. Kolejność
+ * elementów jest dokładnie taka sama jak w kvfifo. push(), pop() i pop(k)
+ * kosztują O(log K), front() i back() O(1). Kopie nie współdzielą danych.
+ */
+template<typename K, typename V>
+class epoch_kvfifo {
+    using stamp_t = std::pair<std::uint64_t, std::uint64_t>;
+
+    struct node_t {
+        std::uint64_t pushed;
+        V value;
+    };
+
+    struct key_entry_t;
+    using order_t = std::map<stamp_t, key_entry_t *>;
+
+    struct key_entry_t {
+        K const *key = nullptr;
+        std::deque<node_t> nodes;
+        std::uint64_t moved = 0;
+        typename order_t::iterator head;
+        typename order_t::iterator tail;
+    };
+
+    using keys_t = std::map<K, key_entry_t>;
+
+public:
+    epoch_kvfifo() = default;
+
+    epoch_kvfifo(epoch_kvfifo const &other) : clock(other.clock), elements(other.elements) {
+        for (auto const &[k, entry] : other.keys) {
+            auto it = keys.insert(keys.end(), {k, key_entry_t()});
+            key_entry_t &copy = it->second;
+            copy.key = &it->first;
+            copy.nodes = entry.nodes;
+            copy.moved = entry.moved;
+            copy.head = heads.insert({entry.head->first, &copy}).first;
+            copy.tail = tails.insert({entry.tail->first, &copy}).first;
+        }
+    }
+
+    epoch_kvfifo(epoch_kvfifo &&other) noexcept = default;
+
+    epoch_kvfifo &operator=(epoch_kvfifo other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    void push(K const &k, V const &v) {
+        auto [it, inserted] = keys.try_emplace(k);
+        key_entry_t &entry = it->second;
+
+        try {
+            entry.key = &it->first;
+            entry.nodes.push_back({++clock, v});
+        } catch (...) {
+            if (inserted) {
+                keys.erase(it);
+            }
+
+            throw;
+        }
+
+        try {
+            stamp_t s = stamp(entry, entry.nodes.back());
+            auto tail = tails.insert({s, &entry}).first;
+
+            if (inserted) {
+                try {
+                    entry.head = heads.insert({s, &entry}).first;
+                } catch (...) {
+                    tails.erase(tail);
+                    throw;
+                }
+            } else {
+                tails.erase(entry.tail);
+            }
+
+            entry.tail = tail;
+        } catch (...) {
+            entry.nodes.pop_back();
+
+            if (inserted) {
+                keys.erase(it);
+            }
+
+            throw;
+        }
+
+        elements++;
+    }
+
+    void pop() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        remove_first(*heads.begin()->second);
+    }
+
+    void pop(K const &k) {
+        remove_first(existing_key(k));
+    }
+
+    void move_to_back(K const &k) {
+        key_entry_t &entry = existing_key(k);
+        std::uint64_t old_moved = entry.moved;
+        entry.moved = ++clock;
+
+        try {
+            auto head = heads.insert({stamp(entry, entry.nodes.front()), &entry}).first;
+
+            try {
+                auto tail = tails.insert({stamp(entry, entry.nodes.back()), &entry}).first;
+                tails.erase(entry.tail);
+                entry.tail = tail;
+            } catch (...) {
+                heads.erase(head);
+                throw;
+            }
+
+            heads.erase(entry.head);
+            entry.head = head;
+        } catch (...) {
+            entry.moved = old_moved;
+            throw;
+        }
+    }
+
+    std::pair<K const &, V const &> front() const {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        key_entry_t const &entry = *heads.begin()->second;
+        return {*entry.key, entry.nodes.front().value};
+    }
+
+    std::pair<K const &, V &> front() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        key_entry_t &entry = *heads.begin()->second;
+        return {*entry.key, entry.nodes.front().value};
+    }
+
+    std::pair<K const &, V const &> back() const {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        key_entry_t const &entry = *tails.rbegin()->second;
+        return {*entry.key, entry.nodes.back().value};
+    }
+
+    std::pair<K const &, V &> back() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        key_entry_t &entry = *tails.rbegin()->second;
+        return {*entry.key, entry.nodes.back().value};
+    }
+
+    std::pair<K const &, V const &> first(K const &key) const {
+        key_entry_t const &entry = existing_key(key);
+        return {*entry.key, entry.nodes.front().value};
+    }
+
+    std::pair<K const &, V &> first(K const &key) {
+        key_entry_t &entry = existing_key(key);
+        return {*entry.key, entry.nodes.front().value};
+    }
+
+    std::pair<K const &, V const &> last(K const &key) const {
+        key_entry_t const &entry = existing_key(key);
+        return {*entry.key, entry.nodes.back().value};
+    }
+
+    std::pair<K const &, V &> last(K const &key) {
+        key_entry_t &entry = existing_key(key);
+        return {*entry.key, entry.nodes.back().value};
+    }
+
+    std::size_t size() const noexcept {
+        return elements;
+    }
+
+    bool empty() const noexcept {
+        return elements == 0;
+    }
+
+    std::size_t count(K const &k) const {
+        auto it = keys.find(k);
+        return it == keys.end() ? 0 : it->second.nodes.size();
+    }
+
+    void clear() noexcept {
+        heads.clear();
+        tails.clear();
+        keys.clear();
+        elements = 0;
+    }
+
+    void swap(epoch_kvfifo &other) noexcept {
+        std::swap(keys, other.keys);
+        std::swap(heads, other.heads);
+        std::swap(tails, other.tails);
+        std::swap(clock, other.clock);
+        std::swap(elements, other.elements);
+    }
+
+    class k_iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = const K;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const K *;
+        using reference = const K &;
+
+        k_iterator() = default;
+
+        explicit k_iterator(typename keys_t::const_iterator it) : it(it) {}
+
+        K const &operator*() const {
+            return it->first;
+        }
+
+        K const *operator->() const {
+            return &it->first;
+        }
+
+        k_iterator &operator++() {
+            ++it;
+            return *this;
+        }
+
+        k_iterator operator++(int) {
+            k_iterator tmp(*this);
+            operator++();
+            return tmp;
+        }
+
+        k_iterator &operator--() {
+            --it;
+            return *this;
+        }
+
+        k_iterator operator--(int) {
+            k_iterator tmp(*this);
+            operator--();
+            return tmp;
+        }
+
+        bool operator==(k_iterator const &other) const {
+            return it == other.it;
+        }
+
+        bool operator!=(k_iterator const &other) const {
+            return it != other.it;
+        }
+
+    private:
+        typename keys_t::const_iterator it;
+    };
+
+    k_iterator k_begin() const {
+        return k_iterator(keys.begin());
+    }
+
+    k_iterator k_end() const {
+        return k_iterator(keys.end());
+    }
+
+private:
+    // Pozycja elementu node klucza entry w kolejce.
+    static stamp_t stamp(key_entry_t const &entry, node_t const &node) noexcept {
+        return {std::max(node.pushed, entry.moved), node.pushed};
+    }
+
+    key_entry_t &existing_key(K const &k) {
+        auto it = keys.find(k);
+
+        if (it == keys.end()) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        return it->second;
+    }
+
+    key_entry_t const &existing_key(K const &k) const {
+        auto it = keys.find(k);
+
+        if (it == keys.end()) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        return it->second;
+    }
+
+    // Usuwa najstarszy element klucza; jedyna alokacja jest przed zmianami.
+    void remove_first(key_entry_t &entry) {
+        if (entry.nodes.size() == 1) {
+            heads.erase(entry.head);
+            tails.erase(entry.tail);
+            keys.erase(keys.find(*entry.key));
+        } else {
+            auto head = heads.insert({stamp(entry, entry.nodes[1]), &entry}).first;
+            heads.erase(entry.head);
+            entry.head = head;
+            entry.nodes.pop_front();
+        }
+
+        elements--;
+    }
+
+    keys_t keys;
+    order_t heads;
+    order_t tails;
+    std::uint64_t clock = 0;
+    std::size_t elements = 0;
+};
+
+#endif
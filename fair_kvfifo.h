@@ -0,0 +1,275 @@
+#ifndef FAIR_KVFIFO_H
+#define FAIR_KVFIFO_H
+
+#include "kvfifo.h"
+#include <cstddef>
+#include <list>
+#include <stdexcept>
+#include <utility>
+
+/**
+ * Kolejka basic_kvfifo, której klucze traktujemy jak klientów obsługiwanych
+ * na zmianę. pop_fair() zdejmuje najstarszy element klucza wskazywanego przez
+ * kursor na pierścieniu kluczy mających elementy; klucz o wadze w dostaje
+ * w jednej kolejce pierścienia do w zdjęć (deficit round robin przy
+ * jednostkowym koszcie elementu). Pierścień pamięta liczbę elementów i wagę
+ * każdego aktywnego klucza, więc pop_fair() kosztuje O(1) plus jedno
+ * wyszukanie klucza w indeksie kolejki, a drugie (w indeksie pierścienia)
+ * tylko wtedy, gdy klucz traci ostatni element - niezależnie od liczby
+ * elementów klucza. Kolejność elementów w obrębie klucza się nie zmienia,
+ * a pop() i pop(k) działają jak w basic_kvfifo.
+ */
+template<typename K, typename V, typename... Policies>
+class fair_kvfifo {
+    // Aktywny klucz na pierścieniu: liczba jego elementów w kolejce i waga.
+    struct ring_entry_t {
+        K key;
+        std::size_t count;
+        std::size_t weight;
+    };
+
+    using ring_t = std::list<ring_entry_t>;
+    using index_policy = typename kvfifo_detail::select_policy<
+        kvfifo_policy::index_tag, kvfifo_policy::ordered_index, Policies...>::type;
+    using active_map_t = typename index_policy::template map_type<K, typename ring_t::iterator>;
+    using weight_map_t = typename index_policy::template map_type<K, std::size_t>;
+
+public:
+    using queue_type = basic_kvfifo<K, V, Policies...>;
+
+private:
+    static constexpr bool nothrow_swap = noexcept(std::declval<queue_type &>().swap(std::declval<queue_type &>()));
+
+public:
+    fair_kvfifo() = default;
+
+    fair_kvfifo(fair_kvfifo const &other)
+        : queue(other.queue), ring(other.ring), weights(other.weights), credit(other.credit) {
+        rebuild_active(other);
+    }
+
+    fair_kvfifo(fair_kvfifo &&other) noexcept(nothrow_swap) {
+        swap(other);
+    }
+
+    fair_kvfifo &operator=(fair_kvfifo other) noexcept(nothrow_swap) {
+        swap(other);
+        return *this;
+    }
+
+    void push(K const &k, V const &v) {
+        auto found = active.find(k);
+        typename ring_t::iterator pos;
+
+        if (found == active.end()) {
+            pos = ring.insert(cursor, {k, 0, weight(k)});
+
+            try {
+                active.insert({k, pos});
+            } catch (...) {
+                ring.erase(pos);
+                throw;
+            }
+
+            if (ring.size() == 1) {
+                cursor = pos;
+            }
+        } else {
+            pos = found->second;
+        }
+
+        try {
+            queue.push(k, v);
+        } catch (...) {
+            if (pos->count == 0) {
+                deactivate(pos);
+            }
+
+            throw;
+        }
+
+        pos->count++;
+    }
+
+    // Element, który zdejmie następne pop_fair().
+    std::pair<K const &, V const &> front_fair() const {
+        if (ring.empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        return queue.first(cursor->key);
+    }
+
+    void pop_fair() {
+        if (ring.empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        if (credit == 0) {
+            credit = cursor->weight;
+        }
+
+        queue.pop(cursor->key);
+        credit--;
+
+        if (--cursor->count == 0) {
+            deactivate(cursor);
+        } else if (credit == 0) {
+            advance();
+        }
+    }
+
+    void pop() {
+        if (queue.empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        auto pos = active.find(std::as_const(queue).front().first)->second;
+        queue.pop();
+        released(pos);
+    }
+
+    void pop(K const &k) {
+        queue.pop(k);
+        released(active.find(k)->second);
+    }
+
+    /**
+     * Ustawia wagę klucza (domyślnie 1): tyle kolejnych pop_fair() może
+     * obsłużyć klucz, zanim kursor przejdzie dalej. Waga 0 jest błędem.
+     */
+    void set_weight(K const &k, std::size_t w) {
+        if (w == 0) {
+            throw std::invalid_argument("Zero weight");
+        }
+
+        auto it = weights.find(k);
+
+        if (it != weights.end()) {
+            it->second = w;
+        } else if (w != 1) {
+            weights.insert({k, w});
+        }
+
+        auto found = active.find(k);
+
+        if (found != active.end()) {
+            found->second->weight = w;
+        }
+    }
+
+    std::size_t weight(K const &k) const {
+        auto it = weights.find(k);
+        return it == weights.end() ? 1 : it->second;
+    }
+
+    std::pair<K const &, V const &> front() const {
+        return queue.front();
+    }
+
+    std::pair<K const &, V const &> back() const {
+        return queue.back();
+    }
+
+    std::pair<K const &, V const &> first(K const &key) const {
+        return queue.first(key);
+    }
+
+    std::pair<K const &, V const &> last(K const &key) const {
+        return queue.last(key);
+    }
+
+    std::size_t size() const noexcept {
+        return queue.size();
+    }
+
+    bool empty() const noexcept {
+        return queue.empty();
+    }
+
+    std::size_t count(K const &k) const {
+        return queue.count(k);
+    }
+
+    // Liczba kluczy na pierścieniu, czyli kluczy mających elementy.
+    std::size_t active_keys() const noexcept {
+        return ring.size();
+    }
+
+    void clear() noexcept {
+        queue.clear();
+        active.clear();
+        ring.clear();
+        cursor = ring.end();
+        credit = 0;
+    }
+
+    void swap(fair_kvfifo &other) noexcept(nothrow_swap) {
+        queue.swap(other.queue);
+        std::swap(ring, other.ring);
+        std::swap(active, other.active);
+        std::swap(weights, other.weights);
+        std::swap(cursor, other.cursor);
+        std::swap(credit, other.credit);
+
+        // Iterator końca pustej listy nie przechodzi razem z jej zawartością.
+        if (ring.empty()) {
+            cursor = ring.end();
+        }
+
+        if (other.ring.empty()) {
+            other.cursor = other.ring.end();
+        }
+    }
+
+private:
+    // Kopia pierścienia ma własne iteratory - odtwarzamy indeks i kursor.
+    void rebuild_active(fair_kvfifo const &other) {
+        cursor = ring.end();
+
+        for (auto it = ring.begin(), from = other.ring.begin(); it != ring.end(); ++it, ++from) {
+            active.insert({it->key, it});
+
+            if (from == other.cursor) {
+                cursor = it;
+            }
+        }
+    }
+
+    void advance() noexcept {
+        if (++cursor == ring.end()) {
+            cursor = ring.begin();
+        }
+
+        credit = 0;
+    }
+
+    // Po zdjęciu elementu klucza z pozycji pos; klucz bez elementów schodzi z pierścienia.
+    void released(typename ring_t::iterator pos) noexcept {
+        if (--pos->count == 0) {
+            deactivate(pos);
+        }
+    }
+
+    void deactivate(typename ring_t::iterator pos) noexcept {
+        if (pos == cursor) {
+            advance();
+        }
+
+        active.erase(active.find(pos->key));
+        ring.erase(pos);
+
+        if (ring.empty()) {
+            cursor = ring.end();
+        }
+    }
+
+    queue_type queue;
+    ring_t ring;
+    active_map_t active;
+    weight_map_t weights;
+    typename ring_t::iterator cursor = ring.end();
+    std::size_t credit = 0;
+};
+
+#endif
@@ -0,0 +1,431 @@
+#ifndef FLAT_KVFIFO_H
+#define FLAT_KVFIFO_H
+
+#include "kvfifo.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Kolejka o interfejsie kvfifo dla trywialnie kopiowalnych K i V. Węzły leżą
+ * w kawałkach po chunk_nodes węzłów i są połączone indeksami, jak
+ * w static_kvfifo, a kopie współdzielą dane do pierwszej modyfikacji.
+ * Odłączenie kopii to memcpy kawałków i kopia indeksu kluczy - bez
+ * przechodzenia po elementach i bez przeliczania wskaźników, bo indeksy
+ * w kopii znaczą to samo. Kawałki nie są przenoszone, gdy kolejka rośnie,
+ * a zniszczenie danych zwalnia kawałki bez niszczenia elementów.
+ */
+template<typename K, typename V>
+class flat_kvfifo {
+    static_assert(std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>,
+                  "flat_kvfifo copies elements with memcpy");
+
+    using index_t = std::uint32_t;
+    static constexpr index_t npos = std::numeric_limits<index_t>::max();
+
+    struct node_t {
+        K key;
+        V value;
+        index_t prev;
+        index_t next;
+        index_t next_same_key;
+    };
+
+    struct key_entry_t {
+        index_t head = npos;
+        index_t tail = npos;
+        std::size_t count = 0;
+    };
+
+    using keys_t = std::map<K, key_entry_t>;
+
+public:
+    static constexpr std::size_t chunk_nodes = 1024;
+
+    /**
+     * Pusta kolejka nie alokuje pamięci - dane tworzymy dopiero przy
+     * pierwszym push().
+     */
+    flat_kvfifo() noexcept = default;
+
+    flat_kvfifo(flat_kvfifo const &other) {
+        if (other.data != nullptr) {
+            data = other.unshareable ? std::make_shared<data_t>(*other.data) : other.data;
+        }
+    }
+
+    flat_kvfifo(flat_kvfifo &&other) noexcept
+        : data(std::move(other.data)), unshareable(std::exchange(other.unshareable, false)) {}
+
+    flat_kvfifo &operator=(flat_kvfifo other) noexcept {
+        std::swap(data, other.data);
+        std::swap(unshareable, other.unshareable);
+        return *this;
+    }
+
+    void push(K const &k, V const &v) {
+        if (data == nullptr) {
+            data = std::make_shared<data_t>();
+        } else {
+            about_to_modify(false);
+        }
+
+        data->reserve_node();
+
+        auto [it, inserted] = data->keys.try_emplace(k);
+        index_t id = data->take_node();
+        ::new (&data->node(id)) node_t{k, v, npos, npos, npos};
+        data->link_back(id);
+
+        key_entry_t &entry = it->second;
+
+        if (entry.tail == npos) {
+            entry.head = id;
+        } else {
+            data->node(entry.tail).next_same_key = id;
+        }
+
+        entry.tail = id;
+        entry.count++;
+        data->elements++;
+    }
+
+    void pop() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        about_to_modify(false);
+        data->remove_first(data->keys.find(data->node(data->head).key));
+    }
+
+    void pop(K const &k) {
+        existing_key(k);
+        about_to_modify(false);
+        data->remove_first(data->keys.find(k));
+    }
+
+    void move_to_back(K const &k) {
+        existing_key(k);
+        about_to_modify(false);
+
+        for (index_t id = data->keys.find(k)->second.head; id != npos; id = data->node(id).next_same_key) {
+            data->unlink(id);
+            data->link_back(id);
+        }
+    }
+
+    std::pair<K const &, V const &> front() const {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        return view(data->head);
+    }
+
+    // Zwrócona referencja do wartości sprawia, że kopie nie współdzielą danych.
+    std::pair<K const &, V &> front() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        about_to_modify(true);
+        return view(data->head);
+    }
+
+    std::pair<K const &, V const &> back() const {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        return view(data->tail);
+    }
+
+    std::pair<K const &, V &> back() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        about_to_modify(true);
+        return view(data->tail);
+    }
+
+    std::pair<K const &, V const &> first(K const &key) const {
+        return view(existing_key(key).head);
+    }
+
+    std::pair<K const &, V &> first(K const &key) {
+        existing_key(key);
+        about_to_modify(true);
+        return view(data->keys.find(key)->second.head);
+    }
+
+    std::pair<K const &, V const &> last(K const &key) const {
+        return view(existing_key(key).tail);
+    }
+
+    std::pair<K const &, V &> last(K const &key) {
+        existing_key(key);
+        about_to_modify(true);
+        return view(data->keys.find(key)->second.tail);
+    }
+
+    std::size_t size() const noexcept {
+        return data == nullptr ? 0 : data->elements;
+    }
+
+    bool empty() const noexcept {
+        return size() == 0;
+    }
+
+    std::size_t count(K const &k) const {
+        if (data == nullptr) {
+            return 0;
+        }
+
+        auto it = data->keys.find(k);
+        return it == data->keys.end() ? 0 : it->second.count;
+    }
+
+    // Niewspółdzielone dane zachowują kawałki dla kolejnych push().
+    void clear() noexcept {
+        if (data == nullptr) {
+            return;
+        }
+
+        if (!kvfifo_detail::exclusive(data, 1)) {
+            data.reset();
+        } else {
+            data->keys.clear();
+            data->head = data->tail = data->free_head = npos;
+            data->used = 0;
+            data->elements = 0;
+        }
+
+        unshareable = false;
+    }
+
+    class k_iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = const K;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const K *;
+        using reference = const K &;
+
+        k_iterator() = default;
+
+        explicit k_iterator(typename keys_t::const_iterator it) : it(it) {}
+
+        K const &operator*() const {
+            return it->first;
+        }
+
+        K const *operator->() const {
+            return &it->first;
+        }
+
+        k_iterator &operator++() {
+            ++it;
+            return *this;
+        }
+
+        k_iterator operator++(int) {
+            k_iterator tmp(*this);
+            operator++();
+            return tmp;
+        }
+
+        k_iterator &operator--() {
+            --it;
+            return *this;
+        }
+
+        k_iterator operator--(int) {
+            k_iterator tmp(*this);
+            operator--();
+            return tmp;
+        }
+
+        bool operator==(k_iterator const &other) const {
+            return it == other.it;
+        }
+
+        bool operator!=(k_iterator const &other) const {
+            return it != other.it;
+        }
+
+    private:
+        typename keys_t::const_iterator it;
+    };
+
+    k_iterator k_begin() const {
+        return data == nullptr ? k_iterator(empty_keys().begin()) : k_iterator(data->keys.begin());
+    }
+
+    k_iterator k_end() const {
+        return data == nullptr ? k_iterator(empty_keys().end()) : k_iterator(data->keys.end());
+    }
+
+private:
+    struct chunk_free {
+        void operator()(node_t *chunk) const noexcept {
+            std::allocator<node_t>().deallocate(chunk, chunk_nodes);
+        }
+    };
+
+    using chunk_ptr = std::unique_ptr<node_t, chunk_free>;
+
+    struct data_t {
+        data_t() = default;
+
+        /**
+         * Węzły są trywialnie kopiowalne, więc kopia kawałka to memcpy użytej
+         * części. Kawałki ponad used (zostawione przez clear()) pomijamy.
+         */
+        data_t(data_t const &other)
+            : keys(other.keys), head(other.head), tail(other.tail), free_head(other.free_head),
+              used(other.used), elements(other.elements) {
+            std::size_t used_chunks = (used + chunk_nodes - 1) / chunk_nodes;
+            chunks.reserve(used_chunks);
+
+            for (std::size_t i = 0; i < used_chunks; i++) {
+                std::size_t nodes = std::min<std::size_t>(chunk_nodes, used - i * chunk_nodes);
+                chunks.push_back(new_chunk());
+                std::memcpy(chunks.back().get(), other.chunks[i].get(), nodes * sizeof(node_t));
+            }
+        }
+
+        static chunk_ptr new_chunk() {
+            return chunk_ptr(std::allocator<node_t>().allocate(chunk_nodes));
+        }
+
+        node_t &node(index_t id) noexcept {
+            return chunks[id / chunk_nodes].get()[id % chunk_nodes];
+        }
+
+        // Zapewnia miejsce na jeden węzeł; jedyny krok push(), który alokuje przed indeksem.
+        void reserve_node() {
+            if (free_head != npos || used < chunks.size() * chunk_nodes) {
+                return;
+            }
+
+            if (used >= npos - chunk_nodes) {
+                throw std::length_error("flat_kvfifo too large");
+            }
+
+            chunks.reserve(chunks.size() + 1);
+            chunks.push_back(new_chunk());
+        }
+
+        index_t take_node() noexcept {
+            if (free_head == npos) {
+                return used++;
+            }
+
+            index_t id = free_head;
+            free_head = node(id).next;
+            return id;
+        }
+
+        void link_back(index_t id) noexcept {
+            node(id).prev = tail;
+            node(id).next = npos;
+
+            if (tail == npos) {
+                head = id;
+            } else {
+                node(tail).next = id;
+            }
+
+            tail = id;
+        }
+
+        void unlink(index_t id) noexcept {
+            node_t &n = node(id);
+
+            if (n.prev == npos) {
+                head = n.next;
+            } else {
+                node(n.prev).next = n.next;
+            }
+
+            if (n.next == npos) {
+                tail = n.prev;
+            } else {
+                node(n.next).prev = n.prev;
+            }
+        }
+
+        void remove_first(typename keys_t::iterator it) noexcept {
+            key_entry_t &entry = it->second;
+            index_t id = entry.head;
+
+            entry.head = node(id).next_same_key;
+            entry.count--;
+
+            unlink(id);
+            node(id).next = free_head;
+            free_head = id;
+            elements--;
+
+            if (entry.count == 0) {
+                keys.erase(it);
+            }
+        }
+
+        std::vector<chunk_ptr> chunks;
+        keys_t keys;
+        index_t head = npos;
+        index_t tail = npos;
+        index_t free_head = npos;
+        index_t used = 0;
+        std::size_t elements = 0;
+    };
+
+    static keys_t const &empty_keys() noexcept {
+        static keys_t const keys;
+        return keys;
+    }
+
+    key_entry_t const &existing_key(K const &k) const {
+        if (data != nullptr) {
+            auto it = data->keys.find(k);
+
+            if (it != data->keys.end()) {
+                return it->second;
+            }
+        }
+
+        throw std::invalid_argument("Key not found");
+    }
+
+    std::pair<K const &, V &> view(index_t id) const noexcept {
+        node_t &n = data->node(id);
+        return {n.key, n.value};
+    }
+
+    // Odłącza współdzielone dane; mark - czy zostaną wydane referencje do wartości.
+    void about_to_modify(bool mark) {
+        if (!kvfifo_detail::exclusive(data, 1)) {
+            data = std::make_shared<data_t>(*data);
+        }
+
+        unshareable = mark;
+    }
+
+    std::shared_ptr<data_t> data;
+    bool unshareable = false;
+};
+
+#endif
@@ -1,292 +1,2735 @@
 #ifndef KVFIFO_H
 #define KVFIFO_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <limits>
 #include <list>
 #include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <optional>
 #include <stdexcept>
+#include <stop_token>
 #include <iterator>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace kvfifo_detail {
+    /**
+     * Rozmiar węzła kontenera węzłowego: links wskaźników, a za nimi wartość
+     * T wyrównana do alignof(T). Dla links == 2 to dokładnie węzeł std::list,
+     * na czym polega reserve().
+     */
+    template<typename T>
+    constexpr std::size_t node_bytes(std::size_t links) noexcept {
+        constexpr std::size_t align = alignof(T) > alignof(void *) ? alignof(T) : alignof(void *);
+        std::size_t value_offset = (links * sizeof(void *) + alignof(T) - 1) / alignof(T) * alignof(T);
+        return (value_offset + sizeof(T) + align - 1) / align * align;
+    }
+
+    /**
+     * Pamięć na stercie zajmowana przez słownik, bez pamięci należącej do
+     * samych kluczy i wartości. Słowniki z tego pliku liczą ją same.
+     */
+    template<typename Map>
+    std::size_t heap_bytes(Map const &map) noexcept {
+        return map.heap_bytes();
+    }
+
+    template<typename Key, typename Mapped, typename Compare, typename Alloc>
+    std::size_t heap_bytes(std::map<Key, Mapped, Compare, Alloc> const &map) noexcept {
+        // Kolor i trzy wskaźniki drzewa czerwono-czarnego.
+        return map.size() * node_bytes<std::pair<Key const, Mapped>>(4);
+    }
+
+    template<typename Key, typename Mapped, typename Hash, typename Equal, typename Alloc>
+    std::size_t heap_bytes(std::unordered_map<Key, Mapped, Hash, Equal, Alloc> const &map) noexcept {
+        // Następnik i zapamiętany hasz w węźle oraz tablica kubełków.
+        return map.size() * node_bytes<std::pair<Key const, Mapped>>(2) +
+               map.bucket_count() * sizeof(void *);
+    }
+
+    template<typename Alloc, typename T>
+    using rebind_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+    // Przygotowuje słownik na keys kluczy, jeśli umie (std::map nie umie).
+    template<typename Map>
+    void reserve_index(Map &map, std::size_t keys) {
+        if constexpr (requires { map.reserve(keys); }) {
+            map.reserve(keys);
+        }
+    }
+
+    /**
+     * Pula węzłów list i słowników jednego kontenera. Zwolniony blok trafia na
+     * listę wolnych bloków swojego rozmiaru (najwyżej recycle_limit bloków na
+     * rozmiar) i jest oddawany przy następnej alokacji tego rozmiaru, więc
+     * kolejka, do której tyle samo wkładamy, co z niej zdejmujemy, nie
+     * korzysta z alokatora Alloc. Bloki pochodzą z Alloc (w jednostkach
+     * wielkości wskaźnika), dlatego pula może przyjąć blok zaalokowany przez
+     * inną pulę o równym alokatorze - listy różnych kontenerów mogą wymieniać
+     * się węzłami przez splice(). Wyjątkiem są bloki z kawałków
+     * zarezerwowanych przez reserve(): te wracają zawsze na listę wolnych
+     * bloków, a pamięć kawałka zwalniamy w całości. Węzły wyrównane ponad
+     * wskaźnik pula poza areną wydaje tylko z takich kawałków. Kontener, do
+     * którego trafiają węzły innego kontenera, musi najpierw przejąć jego
+     * kawałki przez adopt().
+     *
+     * W trybie areny pula niczego nie oddaje pojedynczo: bloki, których
+     * brakuje na listach wolnych, i wszystkie alokacje większe niż jeden
+     * obiekt wycinamy po kolei z kawałków rosnącej wielkości, a zwolnione
+     * pojedyncze bloki zawsze wracają na listę wolnych. Bloki o różnych
+     * wyrównaniach mają osobne listy, więc arena ponownie używa także węzłów
+     * wyrównanych ponad wskaźnik. Pamięć wraca do Alloc dopiero przez
+     * reset() albo razem z pulą, w O(liczba kawałków).
+     */
+    template<typename Alloc>
+    class node_pool {
+        using upstream_type = rebind_alloc<Alloc, void *>;
+        using upstream_traits = std::allocator_traits<upstream_type>;
+        // Kawałki wyrównujemy jak operator new, bo arena trzyma w nich dowolne obiekty.
+        using chunk_unit_type = rebind_alloc<Alloc, std::max_align_t>;
+        using chunk_unit_traits = std::allocator_traits<chunk_unit_type>;
+
+    public:
+        static constexpr std::size_t recycle_limit = 1024;
+        static constexpr std::size_t first_arena_chunk = 4096;
+        static constexpr std::size_t max_arena_chunk = std::size_t(1) << 20;
+
+        explicit node_pool(Alloc const &alloc = Alloc(), bool arena = false) noexcept
+            : upstream(alloc), chunks(upstream), arena(arena) {}
+
+        node_pool(node_pool const &) = delete;
+        node_pool &operator=(node_pool const &) = delete;
+
+        ~node_pool() noexcept {
+            if (!arena) {
+                release_blocks();
+            }
+        }
+
+        // Poza areną align nie może przekraczać alignof(void *).
+        void *allocate(std::size_t bytes, std::size_t align = alignof(void *)) {
+            if (void *block = take(bytes, align)) {
+                return block;
+            }
+
+            if (arena) {
+                return allocate_bytes(bytes, align);
+            }
+
+            return upstream_traits::allocate(upstream, units(bytes));
+        }
+
+        void deallocate(void *p, std::size_t bytes, std::size_t align = alignof(void *)) noexcept {
+            bool reserved = arena || owns(p);
+            free_class_t *free_class = bytes >= sizeof(free_block) ? find_class(bytes, align) : nullptr;
+
+            if (free_class != nullptr && (reserved || free_class->count < recycle_limit)) {
+                free_class->head = ::new (p) free_block{free_class->head};
+                free_class->count++;
+            } else if (!reserved) {
+                upstream_traits::deallocate(upstream, static_cast<void **>(p), units(bytes));
+            }
+        }
+
+        /**
+         * Dokłada bloki rozmiaru bytes z jednego nowego kawałka pamięci, tak
+         * żeby wolnych było co najmniej blocks. Kolejne alokacje dostają je
+         * w kolejności adresów. bytes musi być wielokrotnością align.
+         */
+        void reserve(std::size_t bytes, std::size_t blocks, std::size_t align = alignof(void *)) {
+            free_class_t *free_class = bytes >= sizeof(free_block) ? find_class(bytes, align) : nullptr;
+
+            if (free_class == nullptr || free_class->count >= blocks) {
+                return;
+            }
+
+            std::size_t n = blocks - free_class->count;
+            std::byte *begin = add_chunk(n * bytes, bytes, align);
+
+            for (std::size_t i = n; i-- > 0;) {
+                free_class->head = ::new (begin + i * bytes) free_block{free_class->head};
+            }
+
+            free_class->count += n;
+        }
+
+        // Wolny blok rozmiaru bytes o wyrównaniu align albo nullptr; nie alokuje.
+        void *take(std::size_t bytes, std::size_t align) noexcept {
+            free_class_t *free_class = find_class(bytes, align);
+
+            if (free_class == nullptr || free_class->head == nullptr) {
+                return nullptr;
+            }
+
+            free_block *block = free_class->head;
+            free_class->head = block->next;
+            free_class->count--;
+            return block;
+        }
+
+        // Wyszukiwanie binarne, bo deallocate() pyta o każdy zwalniany węzeł.
+        bool owns(void const *p) const noexcept {
+            auto next = chunk_after(static_cast<std::byte const *>(p));
+            return next != chunks.begin() && std::prev(next)->contains(p);
+        }
+
+        // Współwłasność kawałków other - przed przepięciem jego węzłów tutaj.
+        void adopt(node_pool const &other) {
+            chunks.reserve(chunks.size() + other.chunks.size());
+
+            for (auto const &chunk : other.chunks) {
+                if (!owns(chunk.memory.get())) {
+                    chunks.insert(chunk_after(chunk.memory.get()), chunk);
+                }
+            }
+        }
+
+        // Tylko w trybie areny: bytes bajtów wyrównanych do align <= alignof(std::max_align_t).
+        void *allocate_bytes(std::size_t bytes, std::size_t align) {
+            std::size_t misalign = reinterpret_cast<std::uintptr_t>(cursor) % align;
+            std::size_t pad = misalign == 0 ? 0 : align - misalign;
+
+            if (cursor == nullptr || static_cast<std::size_t>(limit - cursor) < pad + bytes) {
+                std::size_t size = std::max(next_arena_chunk, bytes);
+                cursor = add_chunk(size, 0, 0);
+                limit = cursor + size;
+                next_arena_chunk = std::min(2 * next_arena_chunk, max_arena_chunk);
+                pad = 0;
+            }
+
+            void *p = cursor + pad;
+            cursor += pad + bytes;
+            return p;
+        }
+
+        /**
+         * Oddaje globalnemu alokatorowi zachowane bloki oraz kawałki, których
+         * wszystkie bloki są wolne i których nie przejęła inna pula. Arena
+         * zwalnia pamięć tylko w reset().
+         */
+        void release() noexcept {
+            if (arena) {
+                return;
+            }
+
+            release_blocks();
+
+            for (auto chunk = chunks.begin(); chunk != chunks.end();) {
+                if (chunk->memory.use_count() == 1 && unlink_chunk(*chunk)) {
+                    chunk = chunks.erase(chunk);
+                } else {
+                    ++chunk;
+                }
+            }
+        }
+
+        /**
+         * Zapomina wszystkie bloki i porzuca kawałki (zwolnione zostaną te,
+         * których nie przejęła inna pula). Obiekty, które jeszcze korzystają
+         * z pamięci puli, trzeba wcześniej porzucić.
+         */
+        void reset() noexcept {
+            for (auto &free_class : classes) {
+                free_class.head = nullptr;
+                free_class.count = 0;
+            }
+
+            chunks.clear();
+            cursor = nullptr;
+            limit = nullptr;
+            next_arena_chunk = first_arena_chunk;
+        }
+
+        bool is_arena() const noexcept {
+            return arena;
+        }
+
+        upstream_type get_allocator() const noexcept {
+            return upstream;
+        }
+
+        std::size_t cached_bytes() const noexcept {
+            std::size_t bytes = 0;
+
+            for (auto const &free_class : classes) {
+                bytes += free_class.count * free_class.bytes;
+            }
+
+            return bytes;
+        }
+
+    private:
+        struct free_block {
+            free_block *next;
+        };
+
+        struct free_class_t {
+            std::size_t bytes = 0;
+            std::size_t align = 0;
+            free_block *head = nullptr;
+            std::size_t count = 0;
+        };
+
+        struct chunk_t {
+            std::shared_ptr<std::byte[]> memory;
+            std::size_t bytes;
+            std::size_t block_bytes;
+            std::size_t block_align;
+
+            bool contains(void const *p) const noexcept {
+                auto b = static_cast<std::byte const *>(p);
+                return std::less_equal<>()(memory.get(), b) && std::less<>()(b, memory.get() + bytes);
+            }
+        };
+
+        static std::size_t units(std::size_t bytes) noexcept {
+            return (bytes + sizeof(void *) - 1) / sizeof(void *);
+        }
+
+        /**
+         * Nowy kawałek bytes bajtów wyrównany do block_align; block_bytes == 0
+         * oznacza kawałek areny. Przy wyrównaniu ponad max_align_t alokujemy
+         * zapas, a memory wskazuje (przez aliasing shared_ptr) na wyrównany
+         * początek.
+         */
+        std::byte *add_chunk(std::size_t bytes, std::size_t block_bytes, std::size_t block_align) {
+            std::size_t slack = block_align > alignof(std::max_align_t) ? block_align - alignof(std::max_align_t) : 0;
+            std::size_t total = bytes + slack;
+            std::size_t chunk_units = total / sizeof(std::max_align_t) + (total % sizeof(std::max_align_t) != 0);
+            chunks.reserve(chunks.size() + 1);
+
+            // Blok kontrolny shared_ptr też pochodzi z upstream.
+            chunk_unit_type unit_alloc(upstream);
+            std::max_align_t *raw = chunk_unit_traits::allocate(unit_alloc, chunk_units);
+            std::shared_ptr<std::byte[]> memory(
+                reinterpret_cast<std::byte *>(raw),
+                [unit_alloc, chunk_units](std::byte *p) {
+                    chunk_unit_type alloc(unit_alloc);
+                    chunk_unit_traits::deallocate(alloc, reinterpret_cast<std::max_align_t *>(p), chunk_units);
+                },
+                upstream);
+
+            if (slack != 0) {
+                void *aligned = memory.get();
+                std::align(block_align, bytes, aligned, total);
+                memory = std::shared_ptr<std::byte[]>(memory, static_cast<std::byte *>(aligned));
+            }
+
+            std::byte *begin = memory.get();
+            chunks.insert(chunk_after(begin), {std::move(memory), bytes, block_bytes, block_align});
+            return begin;
+        }
+
+        // Pierwszy kawałek o adresie większym niż p; kawałki są posortowane według adresów.
+        auto chunk_after(std::byte const *p) const noexcept {
+            return std::upper_bound(chunks.begin(), chunks.end(), p, [](std::byte const *b, chunk_t const &chunk) {
+                return std::less<>()(b, chunk.memory.get());
+            });
+        }
+
+        free_class_t *find_class(std::size_t bytes, std::size_t align) noexcept {
+            for (auto &free_class : classes) {
+                // Rozmiary zajmują klasy po kolei, więc wolna klasa jest za zajętymi.
+                if (free_class.bytes == 0) {
+                    free_class.bytes = bytes;
+                    free_class.align = align;
+                }
+
+                if (free_class.bytes == bytes && free_class.align == align) {
+                    return &free_class;
+                }
+            }
+
+            return nullptr;
+        }
+
+        // Zwalnia wolne bloki spoza kawałków; bloki kawałków zostają na liście.
+        void release_blocks() noexcept {
+            for (auto &free_class : classes) {
+                free_block **link = &free_class.head;
+
+                while (*link != nullptr) {
+                    free_block *block = *link;
+
+                    if (owns(block)) {
+                        link = &block->next;
+                    } else {
+                        *link = block->next;
+                        free_class.count--;
+                        upstream_traits::deallocate(upstream, reinterpret_cast<void **>(block),
+                                                    units(free_class.bytes));
+                    }
+                }
+            }
+        }
+
+        // Wypina bloki kawałka z listy, jeśli wszystkie są wolne.
+        bool unlink_chunk(chunk_t const &chunk) noexcept {
+            free_class_t *free_class = find_class(chunk.block_bytes, chunk.block_align);
+            std::size_t free_blocks = 0;
+
+            for (free_block *block = free_class->head; block != nullptr; block = block->next) {
+                free_blocks += chunk.contains(block);
+            }
+
+            if (free_blocks * chunk.block_bytes != chunk.bytes) {
+                return false;
+            }
+
+            for (free_block **link = &free_class->head; *link != nullptr;) {
+                if (chunk.contains(*link)) {
+                    *link = (*link)->next;
+                } else {
+                    link = &(*link)->next;
+                }
+            }
+
+            free_class->count -= free_blocks;
+            return true;
+        }
+
+        [[no_unique_address]] upstream_type upstream;
+        // Listy i słowniki kontenera mają węzły co najwyżej kilku rozmiarów.
+        std::array<free_class_t, 8> classes{};
+        std::vector<chunk_t, rebind_alloc<Alloc, chunk_t>> chunks;
+        bool arena;
+        std::byte *cursor = nullptr;
+        std::byte *limit = nullptr;
+        std::size_t next_arena_chunk = first_arena_chunk;
+    };
+
+    /**
+     * Alokator struktur kontenera: pojedyncze węzły bierze z puli i do niej
+     * oddaje, resztę prosto z alokatora puli (bez puli - z Alloc()), a gdy
+     * pula jest areną - także z puli. Egzemplarze są równe, gdy ich pule
+     * mają równe alokatory - zob. node_pool.
+     */
+    template<typename T, typename Alloc = std::allocator<std::byte>>
+    class pool_allocator {
+        using direct_type = rebind_alloc<Alloc, T>;
+        using direct_traits = std::allocator_traits<direct_type>;
+
+    public:
+        using value_type = T;
+        using is_always_equal = typename std::allocator_traits<Alloc>::is_always_equal;
+        // Lista przeniesiona do wpisu indeksu dalej korzysta z puli kontenera.
+        using propagate_on_container_move_assignment = std::true_type;
+
+        pool_allocator() noexcept = default;
+
+        explicit pool_allocator(node_pool<Alloc> *pool) noexcept : pool(pool) {}
+
+        template<typename U>
+        pool_allocator(pool_allocator<U, Alloc> const &other) noexcept : pool(other.pool) {}
+
+        T *allocate(std::size_t n) {
+            if (pooled(n)) {
+                return static_cast<T *>(pool->allocate(sizeof(T), block_align));
+            }
+
+            if (reserved_only(n)) {
+                if (void *block = pool->take(sizeof(T), block_align)) {
+                    return static_cast<T *>(block);
+                }
+            }
+
+            if (in_arena()) {
+                if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+                    throw std::bad_array_new_length();
+                }
+
+                return static_cast<T *>(pool->allocate_bytes(n * sizeof(T), alignof(T)));
+            }
+
+            direct_type direct(upstream());
+            return direct_traits::allocate(direct, n);
+        }
+
+        void deallocate(T *p, std::size_t n) noexcept {
+            if (pooled(n) || (reserved_only(n) && pool->owns(p))) {
+                pool->deallocate(p, sizeof(T), block_align);
+            } else if (in_arena()) {
+                // Pamięć areny wraca w całości przy node_pool::reset().
+            } else {
+                direct_type direct(upstream());
+                direct_traits::deallocate(direct, p, n);
+            }
+        }
+
+        Alloc upstream() const noexcept {
+            return pool != nullptr ? Alloc(pool->get_allocator()) : Alloc();
+        }
+
+    private:
+        template<typename U, typename A>
+        friend class pool_allocator;
+
+        static constexpr std::size_t block_align = std::max(alignof(T), alignof(void *));
+
+        // Pula oddaje bloki wyrównane do wskaźnika, a arena - do max_align_t.
+        bool pooled(std::size_t n) const noexcept {
+            return n == 1 && pool != nullptr && (alignof(T) <= alignof(void *) || in_arena());
+        }
+
+        bool in_arena() const noexcept {
+            return pool != nullptr && pool->is_arena() && alignof(T) <= alignof(std::max_align_t);
+        }
+
+        // Pozostałe węzły pula oddaje tylko z kawałków zarezerwowanych przez reserve().
+        bool reserved_only(std::size_t n) const noexcept {
+            return n == 1 && pool != nullptr && !pooled(n);
+        }
+
+        node_pool<Alloc> *pool = nullptr;
+    };
+
+    template<typename T, typename U, typename Alloc>
+    bool operator==(pool_allocator<T, Alloc> const &a, pool_allocator<U, Alloc> const &b) noexcept {
+        return a.upstream() == b.upstream();
+    }
+
+    /**
+     * Słownik na posortowanym wektorze: wyszukiwanie binarne w ciągłej
+     * pamięci, kosztem liniowego wstawiania i usuwania kluczy.
+     */
+    template<typename Key, typename Mapped, typename Alloc = std::allocator<std::pair<Key const, Mapped>>>
+    class sorted_vector_map {
+    public:
+        using value_type = std::pair<Key, Mapped>;
+        using allocator_type = rebind_alloc<Alloc, value_type>;
+        using iterator = typename std::vector<value_type, allocator_type>::iterator;
+        using const_iterator = typename std::vector<value_type, allocator_type>::const_iterator;
+
+        sorted_vector_map() = default;
+
+        explicit sorted_vector_map(allocator_type const &alloc) : items(alloc) {}
+
+        allocator_type get_allocator() const noexcept {
+            return items.get_allocator();
+        }
+
+        iterator find(Key const &key) {
+            auto it = lower_bound(key);
+            return it != items.end() && !(key < it->first) ? it : items.end();
+        }
+
+        const_iterator find(Key const &key) const {
+            return const_cast<sorted_vector_map *>(this)->find(key);
+        }
+
+        std::pair<iterator, bool> insert(value_type value) {
+            auto it = lower_bound(value.first);
+
+            if (it != items.end() && !(value.first < it->first)) {
+                return {it, false};
+            }
+
+            return {items.insert(it, std::move(value)), true};
+        }
+
+        iterator erase(iterator it) {
+            return items.erase(it);
+        }
+
+        void clear() noexcept {
+            items.clear();
+        }
+
+        void reserve(std::size_t keys) {
+            items.reserve(keys);
+        }
+
+        std::size_t size() const noexcept {
+            return items.size();
+        }
+
+        std::size_t heap_bytes() const noexcept {
+            return items.capacity() * sizeof(value_type);
+        }
+
+        iterator begin() noexcept { return items.begin(); }
+        iterator end() noexcept { return items.end(); }
+        const_iterator begin() const noexcept { return items.begin(); }
+        const_iterator end() const noexcept { return items.end(); }
+        const_iterator cbegin() const noexcept { return items.cbegin(); }
+        const_iterator cend() const noexcept { return items.cend(); }
+
+    private:
+        iterator lower_bound(Key const &key) {
+            return std::lower_bound(items.begin(), items.end(), key,
+                                    [](value_type const &item, Key const &k) {
+                                        return item.first < k;
+                                    });
+        }
+
+        std::vector<value_type, allocator_type> items;
+    };
+
+    /**
+     * Słownik dla kluczy całkowitych z zadanego z góry przedziału [Lo, Hi]:
+     * wpis klucza leży pod adresem wyznaczonym przez sam klucz, a obecne
+     * klucze są zaznaczone w mapie bitowej, po której przechodzą iteratory
+     * (w kolejności rosnącej). Tablice są alokowane przy pierwszym insert.
+     */
+    template<typename Key, typename Mapped, auto Lo, auto Hi,
+             typename Alloc = std::allocator<std::pair<Key const, Mapped>>>
+    class dense_map {
+        static_assert(std::is_integral_v<Key>, "dense_map needs integral keys");
+        static_assert(Lo <= Hi, "dense_map needs a non-empty key range");
+
+    public:
+        using value_type = std::pair<Key, Mapped>;
+        using allocator_type = rebind_alloc<Alloc, value_type>;
+
+    private:
+        static constexpr std::size_t range = static_cast<std::size_t>(Hi - Lo) + 1;
+        static constexpr std::size_t word_bits = 64;
+
+        template<bool Const>
+        class basic_iterator {
+        public:
+            using iterator_category = std::bidirectional_iterator_tag;
+            using value_type = dense_map::value_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = std::conditional_t<Const, value_type const *, value_type *>;
+            using reference = std::conditional_t<Const, value_type const &, value_type &>;
+            using map_pointer = std::conditional_t<Const, dense_map const *, dense_map *>;
+
+            basic_iterator() = default;
+
+            basic_iterator(map_pointer map, std::size_t pos) : map(map), pos(pos) {}
+
+            operator basic_iterator<true>() const {
+                return {map, pos};
+            }
+
+            reference operator*() const {
+                return map->slots[pos];
+            }
+
+            pointer operator->() const {
+                return &map->slots[pos];
+            }
+
+            basic_iterator &operator++() {
+                pos = map->next_present(pos + 1);
+                return *this;
+            }
+
+            basic_iterator operator++(int) {
+                basic_iterator tmp(*this);
+                operator++();
+                return tmp;
+            }
+
+            basic_iterator &operator--() {
+                pos = map->prev_present(pos);
+                return *this;
+            }
+
+            basic_iterator operator--(int) {
+                basic_iterator tmp(*this);
+                operator--();
+                return tmp;
+            }
+
+            bool operator==(basic_iterator const &other) const {
+                return pos == other.pos;
+            }
+
+            bool operator!=(basic_iterator const &other) const {
+                return pos != other.pos;
+            }
+
+        private:
+            friend class dense_map;
+
+            map_pointer map = nullptr;
+            std::size_t pos = range;
+        };
+
+    public:
+        using iterator = basic_iterator<false>;
+        using const_iterator = basic_iterator<true>;
+
+        dense_map() = default;
+
+        explicit dense_map(allocator_type const &alloc) : slots(alloc), bits(alloc) {}
+
+        allocator_type get_allocator() const noexcept {
+            return slots.get_allocator();
+        }
+
+        iterator find(Key const &key) {
+            std::size_t pos = position(key);
+            return {this, pos < range && present(pos) ? pos : range};
+        }
+
+        const_iterator find(Key const &key) const {
+            return const_cast<dense_map *>(this)->find(key);
+        }
+
+        std::pair<iterator, bool> insert(value_type value) {
+            std::size_t pos = position(value.first);
+
+            if (pos >= range) {
+                throw std::out_of_range("Key out of dense index range");
+            }
+
+            if (slots.empty()) {
+                allocate();
+            } else if (present(pos)) {
+                return {{this, pos}, false};
+            }
+
+            slots[pos] = std::move(value);
+            bits[pos / word_bits] |= std::uint64_t(1) << (pos % word_bits);
+            elements++;
+
+            return {{this, pos}, true};
+        }
+
+        iterator erase(iterator it) {
+            std::size_t pos = it.pos;
+            slots[pos].second = Mapped();
+            bits[pos / word_bits] &= ~(std::uint64_t(1) << (pos % word_bits));
+            elements--;
+
+            return {this, next_present(pos + 1)};
+        }
+
+        void clear() noexcept {
+            for (std::size_t pos = next_present(0); pos < range; pos = next_present(pos + 1)) {
+                slots[pos].second = Mapped();
+            }
+
+            std::fill(bits.begin(), bits.end(), 0);
+            elements = 0;
+        }
+
+        // Tablice i tak obejmują cały przedział - alokujemy je od razu.
+        void reserve(std::size_t) {
+            if (slots.empty()) {
+                allocate();
+            }
+        }
+
+        std::size_t size() const noexcept {
+            return elements;
+        }
+
+        std::size_t heap_bytes() const noexcept {
+            return slots.capacity() * sizeof(value_type) + bits.capacity() * sizeof(std::uint64_t);
+        }
+
+        iterator begin() noexcept { return {this, next_present(0)}; }
+        iterator end() noexcept { return {this, range}; }
+        const_iterator begin() const noexcept { return {this, next_present(0)}; }
+        const_iterator end() const noexcept { return {this, range}; }
+        const_iterator cbegin() const noexcept { return begin(); }
+        const_iterator cend() const noexcept { return end(); }
+
+    private:
+        // Najpierw mapa bitowa: po nieudanym resize(slots) tablice są nadal puste.
+        void allocate() {
+            bits.resize((range + word_bits - 1) / word_bits);
+            slots.resize(range);
+        }
+
+        static std::size_t position(Key const &key) noexcept {
+            if (key < Lo || key > Hi) {
+                return range;
+            }
+
+            return static_cast<std::size_t>(key - Lo);
+        }
+
+        bool present(std::size_t pos) const noexcept {
+            return !bits.empty() && (bits[pos / word_bits] >> (pos % word_bits)) & 1;
+        }
+
+        // Najmniejsza obecna pozycja >= pos albo range.
+        std::size_t next_present(std::size_t pos) const noexcept {
+            if (elements == 0) {
+                return range;
+            }
+
+            std::size_t word = pos / word_bits;
+
+            if (word >= bits.size()) {
+                return range;
+            }
+
+            std::uint64_t w = bits[word] & (~std::uint64_t(0) << (pos % word_bits));
+
+            while (w == 0) {
+                if (++word == bits.size()) {
+                    return range;
+                }
+
+                w = bits[word];
+            }
+
+            return word * word_bits + std::countr_zero(w);
+        }
+
+        // Największa obecna pozycja < pos.
+        std::size_t prev_present(std::size_t pos) const noexcept {
+            std::size_t word = (pos - 1) / word_bits;
+            std::size_t shift = word_bits - 1 - (pos - 1) % word_bits;
+            std::uint64_t w = bits[word] << shift >> shift;
+
+            while (w == 0) {
+                w = bits[--word];
+            }
+
+            return word * word_bits + word_bits - 1 - std::countl_zero(w);
+        }
+
+        std::vector<value_type, allocator_type> slots;
+        std::vector<std::uint64_t, rebind_alloc<Alloc, std::uint64_t>> bits;
+        std::size_t elements = 0;
+    };
+
+    /**
+     * Indeks dla niewielu kluczy: dopóki jest ich co najwyżej Capacity, leżą
+     * posortowane w jednym wektorze, a klucze całkowite są dodatkowo
+     * skopiowane do osobnej tablicy przeszukiwanej wektorowo (AVX2/SSE, z
+     * wersją skalarną). Po przekroczeniu Capacity wpisy są przenoszone do
+     * LargeMap; z powrotem do wektora wracają, gdy indeks się opróżni.
+     */
+    template<typename Key, typename Mapped, std::size_t Capacity, typename LargeMap>
+    class small_map {
+    public:
+        using value_type = std::pair<Key, Mapped>;
+        using allocator_type = rebind_alloc<typename LargeMap::allocator_type, value_type>;
+
+    private:
+        using items_t = std::vector<value_type, allocator_type>;
+        static constexpr bool simd_keys = std::is_integral_v<Key> &&
+                                          (sizeof(Key) == 4 || sizeof(Key) == 8);
+
+        template<typename Mapped_ref>
+        struct entry_ref {
+            Key const &first;
+            Mapped_ref second;
+        };
+
+        template<typename Ref>
+        struct arrow_proxy {
+            Ref ref;
+
+            Ref const *operator->() const {
+                return &ref;
+            }
+        };
+
+        template<bool Const>
+        class basic_iterator {
+            using small_it = std::conditional_t<Const, typename items_t::const_iterator,
+                                                typename items_t::iterator>;
+            using large_it = std::conditional_t<Const, typename LargeMap::const_iterator,
+                                                typename LargeMap::iterator>;
+
+        public:
+            using iterator_category = std::conditional_t<
+                std::is_base_of_v<std::bidirectional_iterator_tag,
+                                  typename std::iterator_traits<large_it>::iterator_category>,
+                std::bidirectional_iterator_tag, std::forward_iterator_tag>;
+            using value_type = small_map::value_type;
+            using difference_type = std::ptrdiff_t;
+            using reference = entry_ref<std::conditional_t<Const, Mapped const &, Mapped &>>;
+            using pointer = arrow_proxy<reference>;
+
+            basic_iterator() = default;
+
+            explicit basic_iterator(small_it it) : small(it) {}
+
+            explicit basic_iterator(large_it it) : large(it), is_small(false) {}
+
+            operator basic_iterator<true>() const {
+                return is_small ? basic_iterator<true>(small) : basic_iterator<true>(large);
+            }
+
+            reference operator*() const {
+                if (is_small) {
+                    return {small->first, small->second};
+                }
+
+                return {large->first, large->second};
+            }
+
+            pointer operator->() const {
+                return {**this};
+            }
+
+            basic_iterator &operator++() {
+                if (is_small) {
+                    ++small;
+                } else {
+                    ++large;
+                }
+
+                return *this;
+            }
+
+            basic_iterator operator++(int) {
+                basic_iterator tmp(*this);
+                operator++();
+                return tmp;
+            }
+
+            basic_iterator &operator--()
+                requires std::is_same_v<iterator_category, std::bidirectional_iterator_tag> {
+                if (is_small) {
+                    --small;
+                } else {
+                    --large;
+                }
+
+                return *this;
+            }
+
+            basic_iterator operator--(int)
+                requires std::is_same_v<iterator_category, std::bidirectional_iterator_tag> {
+                basic_iterator tmp(*this);
+                operator--();
+                return tmp;
+            }
+
+            bool operator==(basic_iterator const &other) const {
+                return is_small == other.is_small &&
+                       (is_small ? small == other.small : large == other.large);
+            }
+
+            bool operator!=(basic_iterator const &other) const {
+                return !(*this == other);
+            }
+
+        private:
+            friend class small_map;
+
+            small_it small{};
+            large_it large{};
+            bool is_small = true;
+        };
+
+    public:
+        using iterator = basic_iterator<false>;
+        using const_iterator = basic_iterator<true>;
+
+        small_map() = default;
+
+        explicit small_map(allocator_type const &alloc)
+            : items(alloc), large(typename LargeMap::allocator_type(alloc)) {}
+
+        allocator_type get_allocator() const noexcept {
+            return items.get_allocator();
+        }
+
+        iterator find(Key const &key) {
+            if (in_large) {
+                return iterator(large.find(key));
+            }
+
+            return iterator(items.begin() + probe(key));
+        }
+
+        const_iterator find(Key const &key) const {
+            return const_cast<small_map *>(this)->find(key);
+        }
+
+        std::pair<iterator, bool> insert(value_type value) {
+            if (in_large) {
+                auto [it, inserted] = large.insert(std::move(value));
+                return {iterator(it), inserted};
+            }
+
+            auto pos = std::lower_bound(items.begin(), items.end(), value.first,
+                                        [](value_type const &item, Key const &k) {
+                                            return item.first < k;
+                                        });
+
+            if (pos != items.end() && !(value.first < pos->first)) {
+                return {iterator(pos), false};
+            }
+
+            if (items.size() == Capacity) {
+                move_to_large();
+                return insert(std::move(value));
+            }
+
+            std::size_t index = pos - items.begin();
+            pos = items.insert(pos, std::move(value));
+
+            if constexpr (simd_keys) {
+                std::copy_backward(keys.begin() + index, keys.begin() + items.size() - 1,
+                                   keys.begin() + items.size());
+                keys[index] = pos->first;
+            }
+
+            return {iterator(pos), true};
+        }
+
+        iterator erase(iterator it) {
+            if (!it.is_small) {
+                auto next = large.erase(it.large);
+
+                if (large.size() == 0) {
+                    in_large = false;
+                    return end();
+                }
+
+                return iterator(next);
+            }
+
+            if constexpr (simd_keys) {
+                std::size_t index = it.small - items.begin();
+                std::copy(keys.begin() + index + 1, keys.begin() + items.size(),
+                          keys.begin() + index);
+            }
+
+            return iterator(items.erase(it.small));
+        }
+
+        void clear() noexcept {
+            items.clear();
+            large.clear();
+            in_large = false;
+        }
+
+        void reserve(std::size_t keys) {
+            if (!in_large) {
+                items.reserve(std::min(keys, Capacity));
+            }
+
+            if (keys > Capacity) {
+                kvfifo_detail::reserve_index(large, keys);
+            }
+        }
+
+        std::size_t size() const noexcept {
+            return in_large ? large.size() : items.size();
+        }
+
+        std::size_t heap_bytes() const noexcept {
+            return items.capacity() * sizeof(value_type) + kvfifo_detail::heap_bytes(large);
+        }
+
+        iterator begin() noexcept {
+            return in_large ? iterator(large.begin()) : iterator(items.begin());
+        }
+
+        iterator end() noexcept {
+            return in_large ? iterator(large.end()) : iterator(items.end());
+        }
+
+        const_iterator begin() const noexcept {
+            return const_cast<small_map *>(this)->begin();
+        }
+
+        const_iterator end() const noexcept {
+            return const_cast<small_map *>(this)->end();
+        }
+
+        const_iterator cbegin() const noexcept { return begin(); }
+        const_iterator cend() const noexcept { return end(); }
+
+    private:
+        // Pozycja klucza w items albo items.size(), jeśli go nie ma.
+        std::size_t probe(Key const &key) const noexcept {
+            std::size_t n = items.size();
+
+            if constexpr (simd_keys) {
+                for (std::size_t base = 0; base < n; base += 64) {
+                    std::uint64_t found = match_mask(keys.data() + base, key,
+                                                     std::min<std::size_t>(64, n - base));
+
+                    if (found != 0) {
+                        return base + std::countr_zero(found);
+                    }
+                }
+
+                return n;
+            } else {
+                auto pos = std::lower_bound(items.begin(), items.end(), key,
+                                            [](value_type const &item, Key const &k) {
+                                                return item.first < k;
+                                            });
+
+                return pos != items.end() && !(key < pos->first) ? pos - items.begin() : n;
+            }
+        }
+
+        /**
+         * Bit i wyniku jest ustawiony, gdy data[i] == key (i < count <= 64).
+         * Porównujemy całe bloki bez wczesnego wyjścia, więc jedynym skokiem
+         * zależnym od danych jest ten w probe(). Bloki mogą wystawać poza
+         * count - tablica keys jest na to dopełniona do wielokrotności 8.
+         */
+        static std::uint64_t match_mask(Key const *data, Key key, std::size_t count) noexcept {
+            std::uint64_t mask = 0;
+            std::size_t i = 0;
+
+            if constexpr (sizeof(Key) == 4) {
+#if defined(__AVX2__)
+                __m256i needle = _mm256_set1_epi32(static_cast<int>(key));
+
+                for (; i < count; i += 8) {
+                    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+                    mask |= std::uint64_t(static_cast<unsigned>(
+                        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(chunk, needle))))) << i;
+                }
+#elif defined(__SSE2__)
+                __m128i needle = _mm_set1_epi32(static_cast<int>(key));
+
+                for (; i < count; i += 4) {
+                    __m128i chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+                    mask |= std::uint64_t(static_cast<unsigned>(
+                        _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(chunk, needle))))) << i;
+                }
+#endif
+            } else {
+#if defined(__AVX2__)
+                __m256i needle = _mm256_set1_epi64x(static_cast<long long>(key));
+
+                for (; i < count; i += 4) {
+                    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+                    mask |= std::uint64_t(static_cast<unsigned>(
+                        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(chunk, needle))))) << i;
+                }
+#elif defined(__SSE4_1__)
+                __m128i needle = _mm_set1_epi64x(static_cast<long long>(key));
+
+                for (; i < count; i += 2) {
+                    __m128i chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+                    mask |= std::uint64_t(static_cast<unsigned>(
+                        _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(chunk, needle))))) << i;
+                }
+#endif
+            }
+
+            for (; i < count; i++) {
+                mask |= std::uint64_t(data[i] == key) << i;
+            }
+
+            return count == 64 ? mask : mask & ((std::uint64_t(1) << count) - 1);
+        }
+
+        /**
+         * Najpierw tworzymy w LargeMap puste wpisy (to może się nie udać),
+         * a dopiero potem przenosimy do nich wartości, co już nie rzuca.
+         */
+        void move_to_large() {
+            LargeMap new_large(large.get_allocator());
+
+            for (auto const &item : items) {
+                new_large.insert({item.first, Mapped()});
+            }
+
+            for (auto &item : items) {
+                new_large.find(item.first)->second = std::move(item.second);
+            }
+
+            large = std::move(new_large);
+            items.clear();
+            in_large = true;
+        }
+
+        items_t items;
+        std::array<std::conditional_t<simd_keys, Key, char>,
+                   simd_keys ? (Capacity + 7) / 8 * 8 : 0> keys{};
+        LargeMap large;
+        bool in_large = false;
+    };
+
+    // Generacje uchwytów basic_kvfifo są unikalne w całym programie.
+    inline std::uint64_t next_handle_generation() noexcept {
+        static std::atomic<std::uint64_t> counter{0};
+        return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    /**
+     * Czy data ma co najwyżej owners właścicieli, czyli czy można ją
+     * zmieniać w miejscu. use_count() czyta licznik bez synchronizacji;
+     * bariera acquire po stwierdzeniu wyłączności synchronizuje nas ze
+     * zwolnieniem ostatniej innej kopii (być może w innym wątku), więc jej
+     * odczyty kończą się przed naszymi zapisami.
+     */
+    template<typename T>
+    bool exclusive(std::shared_ptr<T> const &data, long owners) noexcept {
+        if (data.use_count() > owners) {
+            return false;
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    /**
+     * Wątków prepare_detach() działa w całym programie co najwyżej tyle, ile
+     * jest rdzeni; ponad limit odłączenie zostaje dla pierwszej modyfikacji.
+     */
+    inline std::atomic<unsigned> &running_detaches() noexcept {
+        static std::atomic<unsigned> running{0};
+        return running;
+    }
+
+    inline bool try_start_detach() noexcept {
+        unsigned const limit = std::max(1u, std::thread::hardware_concurrency());
+        auto &running = running_detaches();
+        unsigned now = running.load(std::memory_order_relaxed);
+
+        while (now < limit) {
+            if (running.compare_exchange_weak(now, now + 1, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    inline void finish_detach() noexcept {
+        running_detaches().fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    struct no_mutex {
+        void lock() noexcept {}
+        bool try_lock() noexcept { return true; }
+        void unlock() noexcept {}
+    };
+
+    // Obiekt oddany kvfifo_reclaimer: ogniwo listy oddanych i funkcja, która go niszczy.
+    struct retired_node {
+        retired_node *next_retired = nullptr;
+        void (*dispose)(retired_node *) noexcept = nullptr;
+    };
+
+    struct no_retired_node {};
+
+    template<typename Category, typename Default, typename... Policies>
+    struct select_policy {
+        using type = Default;
+    };
+
+    template<typename Category, typename Default, typename Policy, typename... Policies>
+    struct select_policy<Category, Default, Policy, Policies...> {
+        using type = std::conditional_t<
+            std::is_same_v<typename Policy::category, Category>, Policy,
+            typename select_policy<Category, Default, Policies...>::type>;
+    };
+} // namespace kvfifo_detail
+
+/**
+ * Odroczone niszczenie danych kolejek z polityką deferred_reclamation.
+ * Ostatni właściciel kontenera tylko dopisuje go do listy oddanych (bez
+ * alokacji, pod krótką blokadą), a niszczy go collect() albo wątek
+ * uruchomiony przez start(). Obiekt jest bezpieczny dla wątków, ale start()
+ * i stop() należy wołać z jednego wątku. Niszczony kontener oddaje pamięć
+ * swojemu alokatorowi, więc np. std::pmr::memory_resource kolejki musi żyć,
+ * dopóki collect() albo stop() nie zniszczy wszystkiego, co mu oddała.
+ */
+class kvfifo_reclaimer {
+public:
+    kvfifo_reclaimer() = default;
+
+    kvfifo_reclaimer(kvfifo_reclaimer const &) = delete;
+    kvfifo_reclaimer &operator=(kvfifo_reclaimer const &) = delete;
+
+    ~kvfifo_reclaimer() noexcept {
+        stop();
+        collect();
+    }
+
+    void retire(kvfifo_detail::retired_node *node) noexcept {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            node->next_retired = retired;
+            retired = node;
+            retired_count++;
+        }
+
+        wakeup.notify_one();
+    }
+
+    // Niszczy w bieżącym wątku wszystkie oddane dotąd obiekty; zwraca ich liczbę.
+    std::size_t collect() noexcept {
+        kvfifo_detail::retired_node *list;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            list = std::exchange(retired, nullptr);
+            retired_count = 0;
+        }
+
+        return dispose_all(list);
+    }
+
+    // Liczba oddanych obiektów, których nikt jeszcze nie zaczął niszczyć.
+    std::size_t pending() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return retired_count;
+    }
+
+    // Uruchamia wątek, który niszczy oddane obiekty na bieżąco.
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (!worker.joinable()) {
+            stopping = false;
+            worker = std::thread([this]() { run(); });
+        }
+    }
+
+    /**
+     * Czeka, aż wątek zniszczy wszystko, co oddano przed wywołaniem,
+     * i kończy go. Później oddane obiekty czekają na collect() albo start().
+     */
+    void stop() noexcept {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        wakeup.notify_all();
+
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Reclaimer polityki deferred_reclamation. Nie jest nigdy niszczony,
+     * żeby kolejki statyczne mogły oddawać mu dane do końca programu.
+     */
+    static kvfifo_reclaimer &instance() {
+        static kvfifo_reclaimer *reclaimer = new kvfifo_reclaimer;
+        return *reclaimer;
+    }
+
+private:
+    static std::size_t dispose_all(kvfifo_detail::retired_node *list) noexcept {
+        std::size_t disposed = 0;
+
+        while (list != nullptr) {
+            kvfifo_detail::retired_node *next = list->next_retired;
+            list->dispose(list);
+            list = next;
+            disposed++;
+        }
+
+        return disposed;
+    }
+
+    void run() noexcept {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            wakeup.wait(lock, [this]() { return stopping || retired != nullptr; });
+
+            if (retired == nullptr) {
+                return;
+            }
+
+            kvfifo_detail::retired_node *list = std::exchange(retired, nullptr);
+            retired_count = 0;
+            lock.unlock();
+            dispose_all(list);
+            lock.lock();
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::condition_variable wakeup;
+    kvfifo_detail::retired_node *retired = nullptr;
+    std::size_t retired_count = 0;
+    bool stopping = false;
+    std::thread worker;
+};
+
+/**
+ * Polityki basic_kvfifo. Każda należy do jednej kategorii (indeks kluczy,
+ * przechowywanie elementów, współdzielenie, synchronizacja, alokator,
+ * niszczenie danych); niepodane kategorie przyjmują wartości domyślne
+ * odpowiadające kvfifo.
+ */
+namespace kvfifo_policy {
+    struct index_tag {};
+    struct storage_tag {};
+    struct sharing_tag {};
+    struct locking_tag {};
+    struct allocator_tag {};
+    struct reclamation_tag {};
+
+    // Klucze uporządkowane, std::map.
+    struct ordered_index {
+        using category = index_tag;
+        template<typename Key, typename Mapped, typename Alloc = std::allocator<std::pair<Key const, Mapped>>>
+        using map_type = std::map<Key, Mapped, std::less<Key>, Alloc>;
+    };
+
+    // Tablica haszująca; k_iterator jest wtedy jednokierunkowy i nie
+    // przechodzi kluczy w kolejności rosnącej.
+    struct hashed_index {
+        using category = index_tag;
+        template<typename Key, typename Mapped, typename Alloc = std::allocator<std::pair<Key const, Mapped>>>
+        using map_type = std::unordered_map<Key, Mapped, std::hash<Key>, std::equal_to<Key>, Alloc>;
+    };
+
+    struct sorted_vector_index {
+        using category = index_tag;
+        template<typename Key, typename Mapped, typename Alloc = std::allocator<std::pair<Key const, Mapped>>>
+        using map_type = kvfifo_detail::sorted_vector_map<Key, Mapped, Alloc>;
+    };
+
+    /**
+     * Dla niewielu kluczy (do Capacity) wyszukiwanie liniowe, dla kluczy
+     * całkowitych wektorowe, zamiast schodzenia po drzewie; przy większej
+     * liczbie kluczy indeks przełącza się na LargeIndex.
+     */
+    template<std::size_t Capacity = 64, typename LargeIndex = ordered_index>
+    struct small_index {
+        using category = index_tag;
+        template<typename Key, typename Mapped, typename Alloc = std::allocator<std::pair<Key const, Mapped>>>
+        using map_type = kvfifo_detail::small_map<Key, Mapped, Capacity,
+            typename LargeIndex::template map_type<Key, Mapped, Alloc>>;
+    };
+
+    /**
+     * Dla kluczy całkowitych z małego, gęstego przedziału [Lo, Hi]: count(),
+     * first(), last() i pop(k) nie przeszukują drzewa. Pamięć indeksu jest
+     * proporcjonalna do długości przedziału; push() klucza spoza przedziału
+     * zgłasza std::out_of_range.
+     */
+    template<auto Lo, auto Hi>
+    struct dense_index {
+        using category = index_tag;
+        template<typename Key, typename Mapped, typename Alloc = std::allocator<std::pair<Key const, Mapped>>>
+        using map_type = kvfifo_detail::dense_map<Key, Mapped, Lo, Hi, Alloc>;
+    };
+
+    // std::list z węzłami z puli kontenera (kvfifo_detail::node_pool).
+    struct list_storage {
+        using category = storage_tag;
+        static constexpr bool arena = false;
+        template<typename T, typename Alloc = std::allocator<std::byte>>
+        using list_type = std::list<T, kvfifo_detail::pool_allocator<T, Alloc>>;
+    };
+
+    /**
+     * Jak list_storage, ale pula kontenera jest areną: z niej pochodzi cała
+     * pamięć kontenera, także indeks i tablice uchwytów. clear() i zniszczenie
+     * niewspółdzielonego kontenera porzucają jego struktury i zwalniają
+     * kawałki areny w O(liczba kawałków); elementy niszczymy po kolei tylko
+     * wtedy, gdy K lub V mają nietrywialny destruktor. Pamięć zdjętych
+     * elementów służy kolejnym push() tego kontenera, ale do alokatora wraca
+     * dopiero przy clear() - shrink_to_fit() nic nie robi. Elementy nie mogą
+     * mieć wyrównania większego niż alignof(std::max_align_t).
+     */
+    struct arena_storage {
+        using category = storage_tag;
+        static constexpr bool arena = true;
+        template<typename T, typename Alloc = std::allocator<std::byte>>
+        using list_type = std::list<T, kvfifo_detail::pool_allocator<T, Alloc>>;
+    };
+
+    // Kopie współdzielą dane do pierwszej modyfikacji.
+    struct cow_sharing {
+        using category = sharing_tag;
+        static constexpr bool enabled = true;
+    };
+
+    // Każda kopia od razu dostaje własne dane.
+    struct unique_sharing {
+        using category = sharing_tag;
+        static constexpr bool enabled = false;
+    };
+
+    /**
+     * Alokator całej pamięci kolejki: węzłów, indeksu, tablic uchwytów
+     * i bloku shared_ptr. Kopia kolejki dostaje alokator z
+     * select_on_container_copy_construction() (dla std::pmr - zasób
+     * domyślny), a dane współdzielą tylko kolejki o równych alokatorach.
+     * Stanowy alokator (np. zasób pmr) nie musi być bezpieczny dla wątków,
+     * więc z nim from_range(kvfifo_parallel, ...) i clone(kvfifo_parallel)
+     * budują kolejkę w jednym wątku, a prepare_detach() nic nie robi.
+     */
+    template<typename Alloc>
+    struct with_allocator {
+        using category = allocator_tag;
+        using allocator_type = Alloc;
+    };
+
+    // Ostatni właściciel danych niszczy je od razu.
+    struct inline_reclamation {
+        using category = reclamation_tag;
+        static constexpr bool deferred = false;
+    };
+
+    /**
+     * Ostatni właściciel danych (destruktor, operator=, clear(), odłączenie
+     * od kopii) nie niszczy ich, tylko oddaje kvfifo_reclaimer::instance() -
+     * zniszczy je wątek reclaimera albo jego collect(). Inny reclaimer
+     * wybiera polityka tej samej postaci z własną funkcją reclaimer(); musi
+     * on żyć dłużej niż kolejki, które go używają.
+     * Stanowy alokator, który nie jest bezpieczny dla wątków, wymaga
+     * collect() w wątku, który z niego korzysta, a jego zasób musi żyć do
+     * collect() albo stop() - także po zniszczeniu samych kolejek.
+     */
+    struct deferred_reclamation {
+        using category = reclamation_tag;
+        static constexpr bool deferred = true;
+
+        static kvfifo_reclaimer &reclaimer() {
+            return kvfifo_reclaimer::instance();
+        }
+    };
+
+    struct no_locking {
+        using category = locking_tag;
+        using mutex_type = kvfifo_detail::no_mutex;
+    };
+
+    /**
+     * Każda operacja na obiekcie jest wykonywana pod jego muteksem.
+     * Referencje zwrócone przez front(), first() itd. nie są chronione.
+     * Zablokowanie muteksu może zgłosić wyjątek, więc size(), empty(),
+     * clear() i konstruktor przenoszący nie są wtedy noexcept.
+     */
+    struct mutex_locking {
+        using category = locking_tag;
+        using mutex_type = std::recursive_mutex;
+    };
+} // namespace kvfifo_policy
+
+/**
+ * Wybiera równoległe wersje basic_kvfifo::from_range() i clone(). Wartość
+ * threads == 0 oznacza std::thread::hardware_concurrency().
+ */
+struct kvfifo_parallel {
+    unsigned threads = 0;
+};
+
+/**
+ * Wynik basic_kvfifo::memory_usage(), w bajtach: węzły elementów, węzły list
+ * iteratorów kluczy, indeks kluczy (razem z tablicami uchwytów), blok
+ * z kontenerem i licznikami shared_ptr oraz węzły zachowane w puli do
+ * ponownego użycia. Suma dzieli się na exclusive (tylko ta kolejka) i shared
+ * (współdzielone z sharers - 1 innymi kopiami).
+ */
+struct kvfifo_memory_usage {
+    std::size_t elements = 0;
+    std::size_t key_lists = 0;
+    std::size_t index = 0;
+    std::size_t control_block = 0;
+    std::size_t cached = 0;
+    std::size_t exclusive = 0;
+    std::size_t shared = 0;
+    std::size_t sharers = 0;
+
+    std::size_t total() const noexcept {
+        return elements + key_lists + index + control_block + cached;
+    }
+};
+
+template<typename K, typename V, typename... Policies>
+class basic_kvfifo {
+private:
+    using index_policy = typename kvfifo_detail::select_policy<
+        kvfifo_policy::index_tag, kvfifo_policy::ordered_index, Policies...>::type;
+    using storage_policy = typename kvfifo_detail::select_policy<
+        kvfifo_policy::storage_tag, kvfifo_policy::list_storage, Policies...>::type;
+    using sharing_policy = typename kvfifo_detail::select_policy<
+        kvfifo_policy::sharing_tag, kvfifo_policy::cow_sharing, Policies...>::type;
+    using locking_policy = typename kvfifo_detail::select_policy<
+        kvfifo_policy::locking_tag, kvfifo_policy::no_locking, Policies...>::type;
+    using allocator_policy = typename kvfifo_detail::select_policy<
+        kvfifo_policy::allocator_tag, kvfifo_policy::with_allocator<std::allocator<std::byte>>,
+        Policies...>::type;
+    using reclamation_policy = typename kvfifo_detail::select_policy<
+        kvfifo_policy::reclamation_tag, kvfifo_policy::inline_reclamation, Policies...>::type;
+
+public:
+    using allocator_type = typename allocator_policy::allocator_type;
 
-template<typename K, typename V>
-class kvfifo {
 private:
-    using k_v_queue_t = std::list<std::pair<K const, V>>;
+    using allocator_traits = std::allocator_traits<allocator_type>;
+    // Listy, indeks i tablice uchwytów biorą węzły z puli kontenera.
+    template<typename T>
+    using pool_alloc_t = kvfifo_detail::pool_allocator<T, allocator_type>;
+
+    using mutex_t = typename locking_policy::mutex_type;
+    using lock_t = std::lock_guard<mutex_t>;
+    // std::recursive_mutex::lock() może zgłosić wyjątek - wtedy operacje nie są noexcept.
+    static constexpr bool nothrow_lock = noexcept(std::declval<mutex_t &>().lock());
+
+    /**
+     * Element kolejki: para klucz-wartość i generacja jego uchwytu (0, jeśli
+     * element go nie ma). Dzięki niej usunięcie elementu bez uchwytu nie
+     * zagląda do tablicy uchwytów.
+     */
+    struct element_t : std::pair<K const, V> {
+        element_t(K const &k, V const &v) : std::pair<K const, V>(k, v) {}
+
+        std::uint64_t generation = 0;
+    };
+
+    using k_v_queue_t = typename storage_policy::template list_type<element_t, allocator_type>;
     using k_v_queue_iterator_t = typename k_v_queue_t::iterator;
-    using k_v_map_t = std::map<K, std::list<k_v_queue_iterator_t>>;
+    using k_v_iterator_list_t = typename storage_policy::template list_type<k_v_queue_iterator_t, allocator_type>;
+    using k_v_map_t = typename index_policy::template map_type<
+        K, k_v_iterator_list_t, pool_alloc_t<std::pair<K const, k_v_iterator_list_t>>>;
     using k_v_map_const_iterator_t = typename k_v_map_t::const_iterator;
 
-public:
-    kvfifo() : dataPtr(std::make_shared<container_t>()) {}
+    struct handle_entry_t {
+        k_v_queue_iterator_t elem;
+        typename k_v_iterator_list_t::iterator key_elem;
+    };
+
+    // Uchwyty według generacji; kopia kontenera odtwarza je z generacji elementów.
+    using handles_t = std::unordered_map<std::uint64_t, handle_entry_t, std::hash<std::uint64_t>,
+                                         std::equal_to<std::uint64_t>,
+                                         pool_alloc_t<std::pair<std::uint64_t const, handle_entry_t>>>;
+
+public:
+    /**
+     * Uchwyt elementu zwrócony przez push_with_handle(). Kopie kolejki (także
+     * po odłączeniu danych i w transakcji) zachowują uchwyty swoich
+     * elementów, więc uchwyt wskazuje ten sam element w każdej kopii, która
+     * go zawiera. Przestaje być ważny, gdy element zostanie usunięty, po
+     * clear() oraz gdy partition_by() albo append() do niepustej kolejki
+     * przeniosą element do innej kolejki (append() do pustej kolejki
+     * przekazuje jej dane razem z uchwytami); użycie nieważnego uchwytu
+     * zgłasza std::invalid_argument.
+     * Domyślnie skonstruowany uchwyt nie jest ważny.
+     */
+    class handle {
+    public:
+        handle() = default;
+
+    private:
+        friend class basic_kvfifo;
+
+        explicit handle(std::uint64_t generation) : generation(generation) {}
+
+        std::uint64_t generation = 0;
+    };
+
+    /**
+     * Pusta kolejka nie alokuje pamięci - kontener tworzymy dopiero przy
+     * pierwszym push().
+     */
+    basic_kvfifo() noexcept = default;
+
+    explicit basic_kvfifo(allocator_type const &alloc) noexcept : alloc(alloc) {}
+
+    basic_kvfifo(basic_kvfifo const &other)
+        : basic_kvfifo(other, allocator_traits::select_on_container_copy_construction(other.alloc)) {}
+
+    // Dane other współdzielimy tylko przy równym alokatorze.
+    basic_kvfifo(basic_kvfifo const &other, allocator_type const &alloc) : alloc(alloc) {
+        lock_t lock(other.mutex);
+
+        if (other.dataPtr == nullptr) {
+            return;
+        }
+
+        if (sharing_policy::enabled && !other.unshareable && other.alloc == alloc) {
+            dataPtr = other.dataPtr;
+        } else {
+            dataPtr = make_container(*other.dataPtr, alloc);
+        }
+    }
+
+    basic_kvfifo(basic_kvfifo &&other) noexcept(nothrow_lock) : alloc(other.alloc) {
+        lock_t lock(other.mutex);
+
+        unshareable = other.unshareable;
+        dataPtr = std::move(other.dataPtr);
+        pendingDetach = std::move(other.pendingDetach);
+        other.unshareable = false;
+    }
+
+    ~basic_kvfifo() noexcept = default;
+
+    allocator_type get_allocator() const noexcept {
+        return alloc;
+    }
+
+    // Alokator się nie zmienia - jak w kontenerach std::pmr.
+    // Kopiujemy od razu do naszego alokatora, bez pośredniej kopii.
+    basic_kvfifo &operator=(basic_kvfifo const &other) {
+        if (&other == this) {
+            return *this;
+        }
+
+        std::shared_ptr<container_t> data;
+        {
+            lock_t lock(other.mutex);
+
+            if (other.dataPtr == nullptr || (sharing_policy::enabled && !other.unshareable && other.alloc == alloc)) {
+                data = other.dataPtr;
+            } else {
+                data = make_container(*other.dataPtr, alloc);
+            }
+        }
+
+        lock_t lock(mutex);
+        dataPtr = std::move(data);
+        unshareable = false;
+        pendingDetach.reset();
+
+        return *this;
+    }
+
+    // Przy równych alokatorach przejmujemy dane other razem z zakazem współdzielenia.
+    basic_kvfifo &operator=(basic_kvfifo &&other) noexcept(allocator_traits::is_always_equal::value && nothrow_lock) {
+        basic_kvfifo moved(std::move(other));
+        lock_t lock(mutex);
+
+        if (moved.dataPtr == nullptr || moved.alloc == alloc) {
+            dataPtr = std::move(moved.dataPtr);
+            unshareable = moved.unshareable;
+            pendingDetach = std::move(moved.pendingDetach);
+        } else {
+            dataPtr = make_container(*moved.dataPtr, alloc);
+            unshareable = false;
+            pendingDetach.reset();
+        }
+
+        return *this;
+    }
+
+    /**
+     * Zamienia zawartość kolejek w O(1), razem z zakazami współdzielenia
+     * i przygotowanymi odłączeniami. Alokatory się nie zamieniają: przy
+     * różnych alokatorach elementy są kopiowane do pamięci drugiej kolejki,
+     * więc tylko wtedy swap() może zgłosić wyjątek.
+     */
+    void swap(basic_kvfifo &other) noexcept(allocator_traits::is_always_equal::value && nothrow_lock) {
+        if (&other == this) {
+            return;
+        }
+
+        std::scoped_lock lock(mutex, other.mutex);
+
+        if (alloc == other.alloc) {
+            std::swap(dataPtr, other.dataPtr);
+            std::swap(unshareable, other.unshareable);
+            std::swap(pendingDetach, other.pendingDetach);
+            return;
+        }
+
+        std::shared_ptr<container_t> mine, theirs;
+
+        if (other.dataPtr != nullptr) {
+            mine = make_container(*other.dataPtr, alloc);
+        }
+
+        if (dataPtr != nullptr) {
+            theirs = make_container(*dataPtr, other.alloc);
+        }
+
+        dataPtr = std::move(mine);
+        other.dataPtr = std::move(theirs);
+        unshareable = other.unshareable = false;
+        pendingDetach.reset();
+        other.pendingDetach.reset();
+    }
+
+    friend void swap(basic_kvfifo &a, basic_kvfifo &b) noexcept(noexcept(a.swap(b))) {
+        a.swap(b);
+    }
+
+    void push(K const &k, V const &v) {
+        lock_t lock(mutex);
+
+        copy_guard_t guard(this);
+
+        if (dataPtr == nullptr) {
+            dataPtr = make_container(alloc);
+            unshareable = false;
+        } else {
+            aboutToModify();
+        }
+
+        auto it = dataPtr->iterator_list_map.find(k);
+
+        dataPtr->pair_list.push_back({k, v});
+
+        try {
+            if (it == dataPtr->iterator_list_map.end()) {
+                auto new_list = dataPtr->template make_list<k_v_iterator_list_t>();
+                new_list.push_back(std::prev(dataPtr->pair_list.end()));
+                dataPtr->iterator_list_map.insert({k, std::move(new_list)});
+            } else {
+                it->second.push_back(std::prev(dataPtr->pair_list.end()));
+            }
+        } catch (...) {
+            dataPtr->pair_list.pop_back();
+            throw;
+        }
+
+        guard.no_rollback();
+    }
+
+    void pop() {
+        lock_t lock(mutex);
+
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        copy_guard_t guard(this);
+        aboutToModify();
+
+        auto it = dataPtr->iterator_list_map.find(dataPtr->pair_list.front().first);
+        dataPtr->forget(dataPtr->pair_list.begin());
+        it->second.pop_front();
+
+        if (it->second.empty()) {
+            dataPtr->iterator_list_map.erase(it);
+        }
+
+        dataPtr->pair_list.pop_front();
+
+        guard.no_rollback();
+    }
+
+    void pop(K const &k) {
+        lock_t lock(mutex);
+
+        if (empty()) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        copy_guard_t guard(this);
+        aboutToModify();
+
+        auto it = dataPtr->iterator_list_map.find(k);
+
+        if (it == dataPtr->iterator_list_map.end()) {
+            throw std::invalid_argument("Key not found");
+        } else {
+            dataPtr->forget(it->second.front());
+            dataPtr->pair_list.erase(it->second.front());
+            it->second.pop_front();
+
+            if (it->second.empty()) {
+                dataPtr->iterator_list_map.erase(it);
+            }
+        }
+
+        guard.no_rollback();
+    }
+
+    /**
+     * Usuwa wszystkie elementy o kluczu k; zwraca ich liczbę (0, gdy klucza
+     * nie ma). Szuka klucza w indeksie raz, a drugi raz tylko wtedy, gdy
+     * musi odłączyć kolejkę od kopii.
+     */
+    std::size_t pop_all(K const &k) {
+        lock_t lock(mutex);
+
+        if (dataPtr == nullptr) {
+            return 0;
+        }
+
+        auto it = dataPtr->iterator_list_map.find(k);
+
+        if (it == dataPtr->iterator_list_map.end()) {
+            return 0;
+        }
+
+        copy_guard_t guard(this);
+        container_t const *shared = dataPtr.get();
+        aboutToModify();
+
+        if (dataPtr.get() != shared) {
+            it = dataPtr->iterator_list_map.find(k);
+        }
+
+        std::size_t removed = it->second.size();
+
+        for (auto const &elem : it->second) {
+            dataPtr->forget(elem);
+            dataPtr->pair_list.erase(elem);
+        }
+
+        dataPtr->iterator_list_map.erase(it);
+        guard.no_rollback();
+
+        return removed;
+    }
+
+    /**
+     * Usuwa elementy, dla których pred(klucz, wartość) jest prawdą, i zwraca
+     * ich liczbę. pred jest wołany dokładnie raz dla każdego elementu przed
+     * jakąkolwiek zmianą (kolejno po kluczach, a w obrębie klucza od
+     * najstarszego), więc wyjątek z pred zostawia kolejkę bez zmian. Kolejka
+     * jest odłączana od kopii co najwyżej raz i tylko wtedy, gdy coś usuwamy.
+     */
+    template<typename Pred>
+    std::size_t erase_if(Pred &&pred) {
+        lock_t lock(mutex);
+
+        if (empty()) {
+            return 0;
+        }
+
+        std::vector<char> marks;
+        std::vector<K> emptied;
+        std::size_t removed = 0;
+        marks.reserve(size());
+
+        for (auto const &entry : dataPtr->iterator_list_map) {
+            std::size_t removed_here = 0;
+
+            for (auto const &elem : entry.second) {
+                bool mark = static_cast<bool>(pred(elem->first, std::as_const(elem->second)));
+                marks.push_back(mark);
+                removed_here += mark;
+            }
+
+            if (removed_here == entry.second.size()) {
+                emptied.push_back(entry.first);
+            }
+
+            removed += removed_here;
+        }
+
+        if (removed == 0) {
+            return 0;
+        }
+
+        copy_guard_t guard(this);
+        container_t *source = dataPtr.get();
+        aboutToModify();
+
+        // Od tego miejsca nic już nie zgłasza wyjątków. Znaczniki są
+        // w kolejności indeksu źródła; po sklonowaniu indeks kopii może mieć
+        // inną kolejność (hashed_index), stąd wyszukiwanie klucza w kopii.
+        auto &map = dataPtr->iterator_list_map;
+        auto mark = marks.begin();
+
+        for (auto entry = source->iterator_list_map.begin(); entry != source->iterator_list_map.end(); ++entry) {
+            auto &elems = source == dataPtr.get() ? entry->second : map.find(entry->first)->second;
+
+            for (auto elem = elems.begin(); elem != elems.end(); ++mark) {
+                if (*mark) {
+                    dataPtr->forget(*elem);
+                    dataPtr->pair_list.erase(*elem);
+                    elem = elems.erase(elem);
+                } else {
+                    ++elem;
+                }
+            }
+        }
+
+        for (auto const &k : emptied) {
+            map.erase(map.find(k));
+        }
+
+        guard.no_rollback();
+        return removed;
+    }
+
+    /**
+     * push(), który zwraca uchwyt nowego elementu. Operacje na uchwycie
+     * kosztują O(1) plus co najwyżej jedno wyszukanie klucza w indeksie.
+     */
+    handle push_with_handle(K const &k, V const &v) {
+        lock_t lock(mutex);
+
+        push(k, v);
+
+        auto &keys = dataPtr->iterator_list_map.find(k)->second;
+        std::uint64_t generation = kvfifo_detail::next_handle_generation();
+
+        try {
+            dataPtr->remember(generation, {std::prev(dataPtr->pair_list.end()), std::prev(keys.end())});
+        } catch (...) {
+            // push() odłączył już dane od kopii, więc wycofujemy go w miejscu.
+            keys.pop_back();
+
+            if (keys.empty()) {
+                dataPtr->iterator_list_map.erase(dataPtr->iterator_list_map.find(k));
+            }
+
+            dataPtr->pair_list.pop_back();
+            throw;
+        }
+
+        return handle(generation);
+    }
+
+    bool valid(handle const &h) const noexcept(nothrow_lock) {
+        lock_t lock(mutex);
+
+        return dataPtr != nullptr && dataPtr->handles.find(h.generation) != dataPtr->handles.end();
+    }
+
+    V const &value(handle const &h) const {
+        lock_t lock(mutex);
+
+        return find_handle(h)->second.elem->second;
+    }
+
+    V &value(handle const &h) {
+        lock_t lock(mutex);
+
+        copy_guard_t guard(this);
+        auto entry = detach_handle(h, true);
+        guard.no_rollback();
+
+        return entry->second.elem->second;
+    }
+
+    void erase(handle const &h) {
+        lock_t lock(mutex);
+
+        copy_guard_t guard(this);
+        handle_entry_t entry = detach_handle(h, false)->second;
+        auto it = dataPtr->iterator_list_map.find(entry.elem->first);
+
+        dataPtr->forget(entry.elem);
+        it->second.erase(entry.key_elem);
+
+        if (it->second.empty()) {
+            dataPtr->iterator_list_map.erase(it);
+        }
+
+        dataPtr->pair_list.erase(entry.elem);
+        guard.no_rollback();
+    }
+
+    void move_to_back(handle const &h) {
+        lock_t lock(mutex);
+
+        copy_guard_t guard(this);
+        handle_entry_t entry = detach_handle(h, false)->second;
+        auto &keys = dataPtr->iterator_list_map.find(entry.elem->first)->second;
+
+        keys.splice(keys.end(), keys, entry.key_elem);
+        dataPtr->pair_list.splice(dataPtr->pair_list.end(), dataPtr->pair_list, entry.elem);
+        guard.no_rollback();
+    }
+
+    void move_to_back(K const &k) {
+        lock_t lock(mutex);
+
+        if (empty()) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        copy_guard_t guard(this);
+        aboutToModify();
+
+        auto it = dataPtr->iterator_list_map.find(k);
 
-    kvfifo(kvfifo const &other) {
-        if (!other.unshareable) {
-            dataPtr = other.dataPtr;
-        } else {
-            dataPtr = std::make_shared<container_t>(*other.dataPtr);
+        if (it == dataPtr->iterator_list_map.end()) {
+            throw std::invalid_argument("Key not found");
         }
-    }
 
-    kvfifo(kvfifo &&other) noexcept = default;
+        for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            dataPtr->pair_list.splice(dataPtr->pair_list.end(), dataPtr->pair_list, *it2);
+        }
 
-    ~kvfifo() noexcept = default;
+        guard.no_rollback();
+    }
 
-    kvfifo &operator=(kvfifo other) {
-        if (!other.unshareable) {
-            dataPtr = other.dataPtr;
-        } else {
-            dataPtr = std::make_shared<container_t>(*other.dataPtr);
-        }
+    std::pair<K const &, V const &> front() const {
+        lock_t lock(mutex);
 
-        unshareable = false;
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
 
-        return *this;
+        return {dataPtr->pair_list.front().first, dataPtr->pair_list.front().second};
     }
 
-    void push(K const &k, V const &v) {
-        if (dataPtr == nullptr) {
-            dataPtr = std::make_shared<container_t>();
+    std::pair<K const &, V &> front() {
+        lock_t lock(mutex);
+
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
         }
 
         copy_guard_t guard(this);
-        aboutToModify();
+        aboutToModify(true);
 
-        auto it = dataPtr->iterator_list_map.find(k);
+        guard.no_rollback();
+        return {dataPtr->pair_list.front().first, dataPtr->pair_list.front().second};
+    }
 
-        dataPtr->pair_list.push_back({k, v});
+    std::pair<K const &, V const &> back() const {
+        lock_t lock(mutex);
 
-        try {
-            if (it == dataPtr->iterator_list_map.end()) {
-                std::list<k_v_queue_iterator_t> new_list;
-                new_list.push_back(std::prev(dataPtr->pair_list.end()));
-                dataPtr->iterator_list_map.insert({k, new_list});
-            } else {
-                it->second.push_back(std::prev(dataPtr->pair_list.end()));
-            }
-        } catch (...) {
-            dataPtr->pair_list.pop_back();
-            throw;
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
         }
 
-        guard.no_rollback();
+        return {dataPtr->pair_list.back().first, dataPtr->pair_list.back().second};
     }
 
-    void pop() {
+    std::pair<K const &, V &> back() {
+        lock_t lock(mutex);
+
         if (empty()) {
             throw std::invalid_argument("Empty queue");
         }
 
         copy_guard_t guard(this);
-        aboutToModify();
+        aboutToModify(true);
 
-        auto it = dataPtr->iterator_list_map.find(dataPtr->pair_list.front().first);
-        it->second.pop_front();
+        guard.no_rollback();
+        return {dataPtr->pair_list.back().first,
+                dataPtr->pair_list.back().second};
+    }
 
-        if (it->second.empty()) {
-            dataPtr->iterator_list_map.erase(it);
+    std::pair<K const &, V const &> first(K const &key) const {
+        lock_t lock(mutex);
+
+        if (empty()) {
+            throw std::invalid_argument("Key not found");
         }
 
-        dataPtr->pair_list.pop_front();
+        auto it = dataPtr->iterator_list_map.find(key);
 
-        guard.no_rollback();
+        if (it == dataPtr->iterator_list_map.end()) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        return {it->second.front()->first, it->second.front()->second};
     }
 
-    void pop(K const &k) {
+    std::pair<K const &, V &> first(K const &key) {
+        lock_t lock(mutex);
+
         if (empty()) {
             throw std::invalid_argument("Key not found");
         }
 
         copy_guard_t guard(this);
-        aboutToModify();
+        aboutToModify(true);
 
-        auto it = dataPtr->iterator_list_map.find(k);
+        auto it = dataPtr->iterator_list_map.find(key);
 
         if (it == dataPtr->iterator_list_map.end()) {
             throw std::invalid_argument("Key not found");
-        } else {
-            dataPtr->pair_list.erase(it->second.front());
-            it->second.pop_front();
-
-            if (it->second.empty()) {
-                dataPtr->iterator_list_map.erase(it);
-            }
         }
 
         guard.no_rollback();
+        return {it->second.front()->first, it->second.front()->second};
     }
 
-    void move_to_back(K const &k) {
+    std::pair<K const &, V const &> last(K const &key) const {
+        lock_t lock(mutex);
+
         if (empty()) {
             throw std::invalid_argument("Key not found");
         }
 
-        copy_guard_t guard(this);
-        aboutToModify();
-
-        auto it = dataPtr->iterator_list_map.find(k);
+        auto it = dataPtr->iterator_list_map.find(key);
 
         if (it == dataPtr->iterator_list_map.end()) {
             throw std::invalid_argument("Key not found");
         }
 
-        for (auto it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-            dataPtr->pair_list.splice(dataPtr->pair_list.end(), dataPtr->pair_list, *it2);
+        return {it->second.back()->first, it->second.back()->second};
+    }
+
+    std::pair<K const &, V &> last(K const &key) {
+        lock_t lock(mutex);
+
+        if (empty()) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        copy_guard_t guard(this);
+        aboutToModify(true);
+
+        auto it = dataPtr->iterator_list_map.find(key);
+
+        if (it == dataPtr->iterator_list_map.end()) {
+            throw std::invalid_argument("Key not found");
         }
 
         guard.no_rollback();
+        return {it->second.back()->first, it->second.back()->second};
     }
 
-    std::pair<K const &, V const &> front() const {
+    /**
+     * Modyfikacja wartości bez oddawania referencji na zewnątrz. W odróżnieniu
+     * od nie-const front(), back(), first() i last() nie blokuje późniejszego
+     * współdzielenia danych przez kopie. Jeśli fn zgłosi wyjątek, a dane były
+     * współdzielone, kolejka pozostaje bez zmian; w przeciwnym razie zmiany
+     * dokonane przez fn przed wyjątkiem zostają.
+     */
+    template<typename F>
+    void modify_front(F &&fn) {
+        lock_t lock(mutex);
+
         if (empty()) {
             throw std::invalid_argument("Empty queue");
         }
 
-        return {dataPtr->pair_list.front().first, dataPtr->pair_list.front().second};
+        copy_guard_t guard(this);
+        aboutToModify();
+
+        fn(dataPtr->pair_list.front().second);
+        guard.no_rollback();
     }
 
-    std::pair<K const &, V &> front() {
+    template<typename F>
+    void modify_back(F &&fn) {
+        lock_t lock(mutex);
+
         if (empty()) {
             throw std::invalid_argument("Empty queue");
         }
 
         copy_guard_t guard(this);
-        aboutToModify(true);
+        aboutToModify();
 
+        fn(dataPtr->pair_list.back().second);
         guard.no_rollback();
-        return {dataPtr->pair_list.front().first, dataPtr->pair_list.front().second};
     }
 
-    std::pair<K const &, V const &> back() const {
-        if (empty()) {
-            throw std::invalid_argument("Empty queue");
+    template<typename F>
+    void update(K const &key, F &&fn) {
+        lock_t lock(mutex);
+
+        if (count(key) == 0) {
+            throw std::invalid_argument("Key not found");
         }
 
-        return {dataPtr->pair_list.back().first, dataPtr->pair_list.back().second};
+        copy_guard_t guard(this);
+        aboutToModify();
+
+        fn(dataPtr->iterator_list_map.find(key)->second.front()->second);
+        guard.no_rollback();
     }
 
-    std::pair<K const &, V &> back() {
-        if (empty()) {
-            throw std::invalid_argument("Empty queue");
+    template<typename F>
+    void update_last(K const &key, F &&fn) {
+        lock_t lock(mutex);
+
+        if (count(key) == 0) {
+            throw std::invalid_argument("Key not found");
         }
 
         copy_guard_t guard(this);
-        aboutToModify(true);
+        aboutToModify();
 
+        fn(dataPtr->iterator_list_map.find(key)->second.back()->second);
         guard.no_rollback();
-        return {dataPtr->pair_list.back().first,
-                dataPtr->pair_list.back().second};
     }
 
-    std::pair<K const &, V const &> first(K const &key) const {
+    size_t size() const noexcept(nothrow_lock) {
+        lock_t lock(mutex);
+
+        if (dataPtr == nullptr) {
+            return 0;
+        }
+
+        return dataPtr->pair_list.size();
+    }
+
+    bool empty() const noexcept(nothrow_lock) {
+        lock_t lock(mutex);
+
+        if (dataPtr == nullptr) {
+            return true;
+        }
+
+        return dataPtr->pair_list.empty();
+    }
+
+    size_t count(K const &k) const {
+        lock_t lock(mutex);
+
+        if (dataPtr == nullptr) {
+            return 0;
+        }
+
+        auto it = dataPtr->iterator_list_map.find(k);
+
+        if (it == dataPtr->iterator_list_map.end()) {
+            return 0;
+        } else {
+            return it->second.size();
+        }
+    }
+
+    /**
+     * Wykonuje fn(*this) jako jedną operację: albo wszystkie zmiany dokonane
+     * przez fn zostaną zachowane, albo - jeśli fn zgłosi wyjątek - kolejka
+     * wróci do stanu sprzed wywołania. Dane kopiujemy raz: dane współdzielone
+     * przy pierwszej modyfikacji, a dane tylko nasze na początku, do kopii
+     * zapasowej strażnika - fn zmienia je wtedy w miejscu, więc referencje
+     * do wartości wydane przed transakcją pozostają ważne. Wycofanie
+     * przywraca kopię zapasową w tym samym kontenerze, zostawiając na
+     * miejscu elementy, których fn nie zdjęła - zob. container_t::restore().
+     * Operacje wewnątrz fn nie tworzą własnych kopii zapasowych.
+     * Zagnieżdżone transakcje stają się częścią zewnętrznej.
+     *
+     * Dlatego operacja, która wewnątrz fn zgłosi wyjątek, może zostawić
+     * część swoich zmian; jeśli fn złapie ten wyjątek i działa dalej, te
+     * zmiany zostaną zatwierdzone razem z resztą. Wycofanie obejmuje tylko
+     * tę kolejkę: kolejka opróżniona przez append(std::move(other)) wewnątrz
+     * fn pozostaje pusta także po wycofaniu transakcji.
+     */
+    template<typename F>
+    void transaction(F &&fn) {
+        lock_t lock(mutex);
+
+        if (inTransaction) {
+            fn(*this);
+            return;
+        }
+
+        copy_guard_t guard(this);
+
+        // Strażnik trzyma drugi wskaźnik, więc dane są tylko nasze przy dwóch właścicielach.
+        if (dataPtr != nullptr && (unshareable || kvfifo_detail::exclusive(dataPtr, 2))) {
+            guard.snapshot();
+        }
+
+        inTransaction = true;
+
+        try {
+            fn(*this);
+        } catch (...) {
+            inTransaction = false;
+            throw;
+        }
+
+        inTransaction = false;
+        guard.no_rollback();
+    }
+
+    /**
+     * Dokleja elementy other na koniec kolejki, zachowując ich kolejność;
+     * other zostaje pusta. Jeśli dane other nie są współdzielone, węzły są
+     * przepinane, a nie kopiowane: koszt zależy od liczby kluczy other, nie
+     * od liczby jej elementów.
+     */
+    void append(basic_kvfifo &&other) {
+        if (&other == this) {
+            basic_kvfifo copy(*this);
+            append(std::move(copy));
+            return;
+        }
+
+        std::scoped_lock lock(mutex, other.mutex);
+
+        if (other.empty()) {
+            return;
+        }
+
+        // Węzły kontenera o innym alokatorze trzeba skopiować.
+        std::shared_ptr<container_t> source = other.dataPtr;
+        bool const same_alloc = other.alloc == alloc;
+        bool const steal = (other.unshareable || kvfifo_detail::exclusive(source, 2)) && same_alloc;
+
+        /**
+         * Referencje wydane przez other wskazują teraz na nasze elementy,
+         * więc przejmujemy też jej zakaz współdzielenia.
+         */
+        if (empty() && same_alloc) {
+            dataPtr = std::move(source);
+            unshareable = other.unshareable;
+        } else {
+            copy_guard_t guard(this);
+
+            if (dataPtr == nullptr) {
+                dataPtr = make_container(alloc);
+                unshareable = false;
+            } else {
+                aboutToModify(other.unshareable);
+            }
+
+            if (!steal) {
+                source = make_container(*source, alloc);
+            }
+
+            dataPtr->append(*source);
+            guard.no_rollback();
+        }
+
+        other.dataPtr.reset();
+        other.unshareable = false;
+        other.pendingDetach.reset();
+    }
+
+    // Kopiuje elementy other (lub współdzieli je, jeśli kolejka jest pusta).
+    void append(basic_kvfifo const &other) {
+        append(basic_kvfifo(other, alloc));
+    }
+
+    /**
+     * Rozdziela elementy między buckets kolejek: element o kluczu k trafia do
+     * kolejki o numerze bucket_of(k) (wywoływanej raz dla każdego klucza).
+     * Wynikowe kolejki zachowują względną kolejność elementów, a ta kolejka
+     * zostaje pusta. Elementy są przepinane w jednym przejściu po kolejce,
+     * bez kopiowania, o ile dane nie są współdzielone. Jeśli bucket_of zgłosi
+     * wyjątek lub zwróci numer spoza zakresu (std::out_of_range), kolejka
+     * pozostaje bez zmian.
+     */
+    template<typename F>
+    std::vector<basic_kvfifo> partition_by(std::size_t buckets, F &&bucket_of) {
+        lock_t lock(mutex);
+
+        std::vector<basic_kvfifo> result;
+        result.reserve(buckets);
+
+        for (std::size_t bucket = 0; bucket < buckets; bucket++) {
+            result.emplace_back(alloc);
+        }
+
+        if (empty()) {
+            return result;
+        }
+
+        std::shared_ptr<container_t> source = dataPtr;
+
+        if (!unshareable && !kvfifo_detail::exclusive(source, 2)) {
+            source = make_container(*source, alloc);
+        }
+
+        // Z alokatora kolejki, żeby pmr_kvfifo nie sięgało do globalnej sterty.
+        using bucket_map_t = typename index_policy::template map_type<
+            K, std::size_t, kvfifo_detail::rebind_alloc<allocator_type, std::pair<K const, std::size_t>>>;
+        bucket_map_t bucket_map{typename bucket_map_t::allocator_type(alloc)};
+
+        for (auto &&entry : source->iterator_list_map) {
+            std::size_t bucket = bucket_of(entry.first);
+
+            if (bucket >= buckets) {
+                throw std::out_of_range("Bucket out of range");
+            }
+
+            bucket_map.insert({entry.first, bucket});
+
+            if (result[bucket].dataPtr == nullptr) {
+                result[bucket].dataPtr = make_container(alloc);
+                result[bucket].dataPtr->pool.adopt(source->pool);
+                result[bucket].unshareable = unshareable;
+            }
+
+            container_t &target = *result[bucket].dataPtr;
+            target.iterator_list_map.insert({entry.first, target.template make_list<k_v_iterator_list_t>()});
+        }
+
+        // Od tego miejsca nic już nie zgłasza wyjątków.
+        source->forget_all();
+
+        for (auto &&entry : source->iterator_list_map) {
+            container_t &target = *result[bucket_map.find(entry.first)->second].dataPtr;
+            target.iterator_list_map.find(entry.first)->second.swap(entry.second);
+        }
+
+        for (auto it = source->pair_list.begin(); it != source->pair_list.end();) {
+            auto next = std::next(it);
+            container_t &target = *result[bucket_map.find(it->first)->second].dataPtr;
+            target.pair_list.splice(target.pair_list.end(), source->pair_list, it);
+            it = next;
+        }
+
+        dataPtr.reset();
+        unshareable = false;
+        pendingDetach.reset();
+
+        return result;
+    }
+
+    /**
+     * partition_by() na dwie kolejki: pierwsza dostaje elementy, których
+     * klucze spełniają pred, druga pozostałe.
+     */
+    template<typename Pred>
+    std::pair<basic_kvfifo, basic_kvfifo> split(Pred &&pred) {
+        auto parts = partition_by(2, [&pred](K const &k) -> std::size_t {
+            return pred(k) ? 0 : 1;
+        });
+
+        return {std::move(parts[0]), std::move(parts[1])};
+    }
+
+    // Kolejka z elementów [first, last) - par klucz-wartość, w tej kolejności.
+    template<typename It>
+    static basic_kvfifo from_range(It first, It last, allocator_type const &alloc = allocator_type()) {
+        basic_kvfifo result(alloc);
+
+        if (first != last) {
+            result.dataPtr = make_container(alloc);
+            result.dataPtr->assign(first, last);
+        }
+
+        return result;
+    }
+
+    /**
+     * Jak wyżej, ale zakres jest dzielony na spójne kawałki budowane przez
+     * osobne wątki, a potem sklejane w kolejności (koszt sklejenia zależy
+     * od liczby kluczy w kawałkach, nie od liczby elementów).
+     */
+    template<typename It>
+    static basic_kvfifo from_range(kvfifo_parallel parallel, It first, It last,
+                                   allocator_type const &alloc = allocator_type()) {
+        static_assert(std::is_base_of_v<std::random_access_iterator_tag,
+                                        typename std::iterator_traits<It>::iterator_category>,
+                      "parallel from_range needs random access iterators");
+
+        basic_kvfifo result(alloc);
+        std::size_t n = last - first;
+        std::size_t chunks = chunk_count(n, parallel);
+
+        if (n == 0) {
+            return result;
+        }
+
+        std::vector<It> bounds;
+        for (std::size_t i = 0; i <= chunks; i++) {
+            bounds.push_back(first + n * i / chunks);
+        }
+
+        result.dataPtr = build_parallel(bounds, alloc);
+        return result;
+    }
+
+    /**
+     * Niezależna (niewspółdzieląca danych) kopia kolejki, budowana przez
+     * kilka wątków tak jak w from_range(kvfifo_parallel, ...).
+     */
+    basic_kvfifo clone(kvfifo_parallel parallel) const {
+        lock_t lock(mutex);
+
+        basic_kvfifo result(alloc);
+
         if (empty()) {
-            throw std::invalid_argument("Key not found");
+            return result;
         }
 
-        auto it = dataPtr->iterator_list_map.find(key);
-
-        if (it == dataPtr->iterator_list_map.end()) {
-            throw std::invalid_argument("Key not found");
+        auto const &list = dataPtr->pair_list;
+        std::size_t n = list.size();
+        std::size_t chunks = chunk_count(n, parallel);
+
+        std::vector<typename k_v_queue_t::const_iterator> bounds{list.begin()};
+        auto it = list.begin();
+        for (std::size_t i = 1, pos = 0; i < chunks; i++) {
+            std::size_t next = n * i / chunks;
+            std::advance(it, next - pos);
+            pos = next;
+            bounds.push_back(it);
         }
+        bounds.push_back(list.end());
 
-        return {it->second.front()->first, it->second.front()->second};
+        result.dataPtr = build_parallel(bounds, alloc);
+        return result;
     }
 
-    std::pair<K const &, V &> first(K const &key) {
-        if (empty()) {
-            throw std::invalid_argument("Key not found");
-        }
+    /**
+     * Szacunek pamięci kolejki liczony w O(1) z rozmiarów jej kontenerów,
+     * bez pamięci należącej do samych K i V (np. zawartości napisów). Kopia
+     * przygotowywana przez prepare_detach() nie jest liczona.
+     */
+    kvfifo_memory_usage memory_usage() const noexcept(nothrow_lock) {
+        lock_t lock(mutex);
 
-        copy_guard_t guard(this);
-        aboutToModify(true);
+        kvfifo_memory_usage usage;
 
-        auto it = dataPtr->iterator_list_map.find(key);
+        if (dataPtr == nullptr) {
+            return usage;
+        }
 
-        if (it == dataPtr->iterator_list_map.end()) {
-            throw std::invalid_argument("Key not found");
+        std::size_t n = dataPtr->pair_list.size();
+        usage.elements = n * kvfifo_detail::node_bytes<typename k_v_queue_t::value_type>(2);
+        usage.key_lists = n * kvfifo_detail::node_bytes<k_v_queue_iterator_t>(2);
+        usage.index = kvfifo_detail::heap_bytes(dataPtr->iterator_list_map) +
+                      kvfifo_detail::heap_bytes(dataPtr->handles);
+        // Blok z make_shared: kontener, wskaźnik na tablicę wirtualną i dwa liczniki.
+        usage.control_block = sizeof(container_t) + sizeof(void *) + 2 * sizeof(long);
+        usage.cached = dataPtr->pool.cached_bytes();
+        usage.sharers = static_cast<std::size_t>(dataPtr.use_count());
+
+        if (usage.sharers > 1) {
+            usage.shared = usage.total();
+        } else {
+            usage.exclusive = usage.total();
         }
 
-        guard.no_rollback();
-        return {it->second.front()->first, it->second.front()->second};
+        return usage;
     }
 
-    std::pair<K const &, V const &> last(K const &key) const {
-        if (empty()) {
-            throw std::invalid_argument("Key not found");
+    void clear() noexcept(nothrow_lock) {
+        lock_t lock(mutex);
+
+        if (dataPtr == nullptr) {
+            return;
         }
 
-        auto it = dataPtr->iterator_list_map.find(key);
+        /**
+         * Współdzielonego kontenera nie kopiujemy tylko po to, żeby go
+         * wyczyścić - wystarczy przestać go współdzielić. Przy odroczonym
+         * niszczeniu niewspółdzielony kontener też tylko oddajemy.
+         */
+        bool drop = !unshareable && !kvfifo_detail::exclusive(dataPtr, 1);
 
-        if (it == dataPtr->iterator_list_map.end()) {
-            throw std::invalid_argument("Key not found");
+        if constexpr (reclamation_policy::deferred) {
+            drop = drop || dataPtr.use_count() == 1;
         }
 
-        return {it->second.back()->first, it->second.back()->second};
+        if (drop) {
+            dataPtr.reset();
+        } else {
+            dataPtr->clear();
+        }
+
+        unshareable = false;
+        pendingDetach.reset();
     }
 
-    std::pair<K const &, V &> last(K const &key) {
-        if (empty()) {
-            throw std::invalid_argument("Key not found");
-        }
+    /**
+     * Przygotowuje kolejkę na elements elementów i distinct_keys kluczy:
+     * brakujące węzły każdego rodzaju alokujemy jednym kawałkiem pamięci,
+     * a indeks rezerwuje miejsce na klucze, jeśli umie. push() do tego
+     * rozmiaru nie alokuje wtedy węzłów, a kolejne elementy leżą obok siebie.
+     * Węzły std::map i std::unordered_map (ordered_index, hashed_index) są
+     * i tak alokowane przy pierwszym push() klucza. Współdzielone dane są
+     * najpierw kopiowane.
+     */
+    void reserve(std::size_t elements, std::size_t distinct_keys = 0) {
+        lock_t lock(mutex);
 
         copy_guard_t guard(this);
-        aboutToModify(true);
 
-        auto it = dataPtr->iterator_list_map.find(key);
+        if (dataPtr == nullptr) {
+            dataPtr = make_container(alloc);
+            unshareable = false;
+        } else {
+            aboutToModify();
+        }
 
-        if (it == dataPtr->iterator_list_map.end()) {
-            throw std::invalid_argument("Key not found");
+        std::size_t missing = elements - std::min(elements, dataPtr->pair_list.size());
+        std::size_t elem_bytes = kvfifo_detail::node_bytes<typename k_v_queue_t::value_type>(2);
+        std::size_t key_elem_bytes = kvfifo_detail::node_bytes<k_v_queue_iterator_t>(2);
+        constexpr std::size_t elem_align = std::max(alignof(typename k_v_queue_t::value_type), alignof(void *));
+
+        // Węzły obu list mogą mieć ten sam rozmiar i wspólną listę wolnych bloków.
+        if (elem_bytes == key_elem_bytes && elem_align == alignof(void *)) {
+            dataPtr->pool.reserve(elem_bytes, 2 * missing);
+        } else {
+            dataPtr->pool.reserve(elem_bytes, missing, elem_align);
+            dataPtr->pool.reserve(key_elem_bytes, missing);
         }
 
+        kvfifo_detail::reserve_index(dataPtr->iterator_list_map, distinct_keys);
+
         guard.no_rollback();
-        return {it->second.back()->first, it->second.back()->second};
     }
 
-    size_t size() const noexcept {
-        if (dataPtr == nullptr) {
-            return 0;
+    /**
+     * Oddaje globalnemu alokatorowi węzły, które pop(), pop(k) i clear()
+     * zachowały do ponownego użycia, oraz nieużywane kawałki z reserve().
+     * Pula współdzielonego kontenera należy też do innych kopii, więc jej
+     * nie ruszamy.
+     */
+    void shrink_to_fit() noexcept(nothrow_lock) {
+        lock_t lock(mutex);
+
+        if (dataPtr != nullptr && kvfifo_detail::exclusive(dataPtr, 1)) {
+            dataPtr->pool.release();
         }
-
-        return dataPtr->pair_list.size();
     }
 
-    bool empty() const noexcept {
-        if (dataPtr == nullptr) {
-            return true;
+    /**
+     * Zaczyna w osobnym wątku kopiowanie współdzielonych danych, które
+     * normalnie wykonałaby dopiero pierwsza modyfikacja. Ta modyfikacja
+     * przejmie gotową kopię zamiast kopiować całą kolejkę; jeśli przyjdzie
+     * przed końcem kopiowania, czeka na nie. Wątek należy do kolejki: gdy
+     * kolejka dostanie inne dane albo zostanie zniszczona, przerywamy
+     * kopiowanie i czekamy na wątek. Jeśli dane nie są współdzielone albo
+     * działa już limit wątków odłączania, nic nie robi.
+     */
+    void prepare_detach() {
+        if constexpr (!allocator_traits::is_always_equal::value) {
+            return;
         }
 
-        return dataPtr->pair_list.empty();
-    }
+        lock_t lock(mutex);
 
-    size_t count(K const &k) const {
-        if (dataPtr == nullptr) {
-            return 0;
+        if (dataPtr == nullptr || dataPtr.use_count() < 2 || unshareable) {
+            return;
         }
 
-        auto it = dataPtr->iterator_list_map.find(k);
-
-        if (it == dataPtr->iterator_list_map.end()) {
-            return 0;
-        } else {
-            return it->second.size();
+        if (pendingDetach != nullptr && pendingDetach->source == dataPtr) {
+            return;
         }
-    }
 
-    void clear() {
-        if (dataPtr == nullptr) {
+        pendingDetach.reset();
+
+        /**
+         * pending_detach_t trzyma wskaźnik na źródło, więc do końca
+         * kopiowania nikt nie zmodyfikuje go w miejscu (use_count()
+         * pozostaje większe od 2).
+         */
+        auto pending = std::make_unique<pending_detach_t>();
+        std::promise<std::shared_ptr<container_t>> promise;
+        pending->source = dataPtr;
+        pending->clone = promise.get_future();
+
+        if (!kvfifo_detail::try_start_detach()) {
             return;
         }
 
-        copy_guard_t guard(this);
-        aboutToModify();
+        try {
+            pending->worker = std::jthread(
+                [alloc = alloc, source = pending->source, promise = std::move(promise)](std::stop_token stop) mutable {
+                    try {
+                        auto copy = make_container(alloc);
+                        copy->copy_from(*source, stop);
+                        promise.set_value(std::move(copy));
+                    } catch (...) {
+                        promise.set_exception(std::current_exception());
+                    }
+
+                    kvfifo_detail::finish_detach();
+                });
+        } catch (...) {
+            kvfifo_detail::finish_detach();
+            throw;
+        }
 
-        dataPtr->pair_list.clear();
-        dataPtr->iterator_list_map.clear();
-        guard.no_rollback();
+        pendingDetach = std::move(pending);
     }
 
     class k_iterator {
     public:
-        using iterator_category = std::bidirectional_iterator_tag;
+        using iterator_category = std::conditional_t<
+            std::is_base_of_v<std::bidirectional_iterator_tag,
+                              typename std::iterator_traits<k_v_map_const_iterator_t>::iterator_category>,
+            std::bidirectional_iterator_tag, std::forward_iterator_tag>;
         using value_type = const K;
         using difference_type = std::ptrdiff_t;
         using pointer = const K *;
@@ -315,12 +2758,14 @@ public:
             return tmp;
         }
 
-        k_iterator &operator--() {
+        k_iterator &operator--()
+            requires std::is_same_v<iterator_category, std::bidirectional_iterator_tag> {
             --it;
             return *this;
         }
 
-        k_iterator operator--(int) {
+        k_iterator operator--(int)
+            requires std::is_same_v<iterator_category, std::bidirectional_iterator_tag> {
             k_iterator tmp(*this);
             operator--();
             return tmp;
@@ -339,6 +2784,8 @@ public:
     };
 
     k_iterator k_begin() const {
+        lock_t lock(mutex);
+
         if (dataPtr == nullptr) {
             return k_iterator();
         }
@@ -347,6 +2794,8 @@ public:
     }
 
     k_iterator k_end() const {
+        lock_t lock(mutex);
+
         if (dataPtr == nullptr) {
             return k_iterator();
         }
@@ -355,13 +2804,45 @@ public:
     }
 
 private:
+    typename handles_t::const_iterator find_handle(handle const &h) const {
+        if (dataPtr == nullptr) {
+            throw std::invalid_argument("Invalid handle");
+        }
+
+        auto entry = dataPtr->handles.find(h.generation);
+
+        if (entry == dataPtr->handles.end()) {
+            throw std::invalid_argument("Invalid handle");
+        }
+
+        return entry;
+    }
+
+    // aboutToModify() dla operacji na uchwycie; kopia danych zachowuje uchwyty.
+    typename handles_t::iterator detach_handle(handle const &h, bool markUnshareable) {
+        find_handle(h);
+        aboutToModify(markUnshareable);
+
+        return dataPtr->handles.find(h.generation);
+    }
+
     void aboutToModify(bool markUnshareable = false) {
         /**
          * Sprawdzamy czy use_count() > 2, a nie czy unique(), bo na pewno
-         * jeden wskaźnik jest nasz a drugi w copy_guard_t.
+         * jeden wskaźnik jest nasz a drugi w copy_guard_t. W transakcji
+         * strażnik całej transakcji trzyma albo głęboką kopię (wtedy dane są
+         * tylko nasze), albo drugi wskaźnik na współdzielone dane, ale tylko
+         * do pierwszego odłączenia - potem dane należą wyłącznie do nas.
          */
-        if (dataPtr.use_count() > 2 && !unshareable) {
-            dataPtr = std::make_shared<container_t>(*dataPtr);
+        std::unique_ptr<pending_detach_t> pending = std::move(pendingDetach);
+        long const owners = inTransaction ? 1 : 2;
+
+        if (!unshareable && !kvfifo_detail::exclusive(dataPtr, owners)) {
+            if (pending != nullptr && pending->source == dataPtr) {
+                dataPtr = pending->clone.get();
+            } else {
+                dataPtr = make_container(*dataPtr, alloc);
+            }
         }
 
         if (markUnshareable) {
@@ -371,14 +2852,104 @@ private:
         }
     }
 
-    struct container_t {
-        container_t() = default;
+    /**
+     * Listy, indeks i tablice uchwytów kontenera biorą węzły z jego puli
+     * i do niej je oddają. Trzymają wskaźnik na pulę, dlatego kontenera nie
+     * przenosimy.
+     */
+    struct container_t : std::conditional_t<reclamation_policy::deferred, kvfifo_detail::retired_node,
+                                            kvfifo_detail::no_retired_node> {
+        static_assert(!storage_policy::arena || alignof(element_t) <= alignof(std::max_align_t),
+                      "arena_storage does not support over-aligned elements");
+
+        explicit container_t(allocator_type const &alloc)
+            : pool(alloc, storage_policy::arena), iterator_list_map(empty_map()), pair_list(make_list<k_v_queue_t>()),
+              handles(pool_alloc_t<typename handles_t::value_type>(&pool)) {}
+
+        container_t(container_t const &other, allocator_type const &alloc) : container_t(alloc) {
+            copy_from(other);
+        }
+
+        container_t(container_t const &other) = delete;
+        container_t(container_t &&other) = delete;
+
+        ~container_t() noexcept {
+            if constexpr (storage_policy::arena) {
+                clear();
+            }
+        }
+
+        /**
+         * W trybie areny struktury nie zwalniają węzłów po kolei: zastępujemy
+         * je pustymi bez wywoływania destruktorów (nic poza zwolnieniem
+         * pamięci nie robią), a pamięć oddaje pool.reset(). Wcześniej
+         * niszczymy elementy i klucze indeksu, jeśli ich destruktory coś robią.
+         */
+        void clear() noexcept {
+            if constexpr (storage_policy::arena) {
+                if constexpr (!std::is_trivially_destructible_v<K> || !std::is_trivially_destructible_v<V>) {
+                    pair_list.clear();
+                    iterator_list_map.clear();
+                }
+
+                std::construct_at(&iterator_list_map, empty_map());
+                std::construct_at(&pair_list, make_list<k_v_queue_t>());
+                std::construct_at(&handles, pool_alloc_t<typename handles_t::value_type>(&pool));
+                pool.reset();
+            } else {
+                handles.clear();
+                pair_list.clear();
+                iterator_list_map.clear();
+            }
+        }
+
+        /**
+         * Kopia elementów other razem z ich uchwytami. Zwraca false, jeśli
+         * kopiowanie przerwało żądanie zatrzymania.
+         */
+        bool copy_from(container_t const &other, std::stop_token const &stop = {}) {
+            if (!assign(other.pair_list.begin(), other.pair_list.end(), stop)) {
+                return false;
+            }
+
+            if (other.handles.empty()) {
+                return true;
+            }
+
+            handles.reserve(other.handles.size());
+            auto it = pair_list.begin();
+
+            for (auto const &elem : other.pair_list) {
+                (it++)->generation = elem.generation;
+            }
+
+            for (auto &&entry : iterator_list_map) {
+                for (auto key_elem = entry.second.begin(); key_elem != entry.second.end(); ++key_elem) {
+                    if ((*key_elem)->generation != 0) {
+                        handles.insert({(*key_elem)->generation, {*key_elem, key_elem}});
+                    }
+                }
+            }
+
+            return true;
+        }
 
-        container_t(container_t const &other) {
-            k_v_map_t new_map;
-            k_v_queue_t new_list;
+        /**
+         * Zastępuje zawartość elementami z [first, last) (parami klucz-wartość).
+         * Po żądaniu zatrzymania przez stop przerywa kopiowanie, zostawia
+         * zawartość bez zmian i zwraca false.
+         */
+        template<typename It>
+        bool assign(It first, It last, std::stop_token const &stop = {}) {
+            k_v_map_t new_map(iterator_list_map.get_allocator());
+            auto new_list = make_list<k_v_queue_t>();
+            std::size_t copied = 0;
+
+            for (auto it = first; it != last; ++it) {
+                if (++copied % 4096 == 0 && stop.stop_requested()) {
+                    return false;
+                }
 
-            for (auto it = other.pair_list.begin(); it != other.pair_list.end(); ++it) {
                 new_list.push_back({it->first, it->second});
             }
 
@@ -386,9 +2957,9 @@ private:
                 auto key_it = new_map.find(it->first);
 
                 if (key_it == new_map.end()) {
-                    std::list<k_v_queue_iterator_t> new_it_list;
+                    auto new_it_list = make_list<k_v_iterator_list_t>();
                     new_it_list.push_back(it);
-                    new_map.insert({it->first, new_it_list});
+                    new_map.insert({it->first, std::move(new_it_list)});
                 } else {
                     key_it->second.push_back(it);
                 }
@@ -396,42 +2967,391 @@ private:
 
             std::swap(iterator_list_map, new_map);
             std::swap(pair_list, new_list);
+            return true;
+        }
+
+        /**
+         * Przepina wszystkie elementy other na koniec. Najpierw przejmujemy
+         * kawałki pamięci other i zakładamy wpisy dla nowych kluczy (jedyne
+         * kroki, które mogą się nie udać - wtedy wpisy usuwamy), potem już
+         * bez wyjątków przepinamy listy.
+         */
+        void append(container_t &other) {
+            pool.adopt(other.pool);
+
+            for (auto &&entry : other.iterator_list_map) {
+                if (iterator_list_map.find(entry.first) != iterator_list_map.end()) {
+                    continue;
+                }
+
+                try {
+                    iterator_list_map.insert({entry.first, make_list<k_v_iterator_list_t>()});
+                } catch (...) {
+                    for (auto &&added : other.iterator_list_map) {
+                        auto it = iterator_list_map.find(added.first);
+
+                        if (it != iterator_list_map.end() && it->second.empty()) {
+                            iterator_list_map.erase(it);
+                        }
+                    }
+
+                    throw;
+                }
+            }
+
+            for (auto &&entry : other.iterator_list_map) {
+                auto &its = iterator_list_map.find(entry.first)->second;
+                its.splice(its.end(), entry.second);
+            }
+
+            pair_list.splice(pair_list.end(), other.pair_list);
+            other.iterator_list_map.clear();
+            other.forget_all();
+        }
+
+        /**
+         * Przywraca zawartość snapshot - kopii tego kontenera zrobionej,
+         * gdy before[i] był adresem węzła i-tego elementu. Węzeł, który wciąż
+         * jest w kolejce pod adresem before[i] i ma równoważny klucz, zostaje
+         * na miejscu i dostaje z powrotem wartość i uchwyt z kopii, więc
+         * referencje do niego pozostają ważne (jeśli pod tym adresem jest już
+         * nowy element, referencje do starego i tak straciły ważność przy
+         * jego zdjęciu). Pozostałe węzły przepinamy ze snapshot. Przy wyjątku
+         * część wartości może już być przywrócona - wywołujący porzuca wtedy
+         * kontener na rzecz snapshot.
+         */
+        void restore(container_t &snapshot, std::vector<element_t const *> const &before) {
+            struct restored_t {
+                k_v_queue_iterator_t from;
+                k_v_queue_iterator_t node;
+            };
+
+            std::vector<std::pair<element_t const *, k_v_queue_iterator_t>> live;
+            live.reserve(pair_list.size());
+
+            for (auto it = pair_list.begin(); it != pair_list.end(); ++it) {
+                live.push_back({&*it, it});
+            }
+
+            auto by_address = [](auto const &a, auto const &b) {
+                return std::less<>()(a.first, b.first);
+            };
+            std::sort(live.begin(), live.end(), by_address);
+
+            pool.adopt(snapshot.pool);
+            k_v_map_t new_map(empty_map());
+            handles_t new_handles{pool_alloc_t<typename handles_t::value_type>(&pool)};
+            std::vector<restored_t> order;
+            order.reserve(snapshot.pair_list.size());
+            std::size_t i = 0;
+
+            for (auto it = snapshot.pair_list.begin(); it != snapshot.pair_list.end(); ++it, ++i) {
+                auto key_it = new_map.find(it->first);
+
+                if (key_it == new_map.end()) {
+                    key_it = new_map.insert({it->first, make_list<k_v_iterator_list_t>()}).first;
+                }
+
+                k_v_queue_iterator_t node = it;
+                auto found = std::lower_bound(live.begin(), live.end(), std::make_pair(before[i], node), by_address);
+
+                if (found != live.end() && found->first == before[i] && new_map.find(found->second->first) == key_it) {
+                    node = found->second;
+                }
+
+                key_it->second.push_back(node);
+                order.push_back({it, node});
+            }
+
+            for (auto &&restored : order) {
+                if (&*restored.node != &*restored.from) {
+                    restored.node->second = restored.from->second;
+                    restored.node->generation = restored.from->generation;
+                }
+            }
+
+            new_handles.reserve(snapshot.handles.size());
+
+            for (auto &&entry : new_map) {
+                for (auto key_elem = entry.second.begin(); key_elem != entry.second.end(); ++key_elem) {
+                    if ((*key_elem)->generation != 0) {
+                        new_handles.insert({(*key_elem)->generation, {*key_elem, key_elem}});
+                    }
+                }
+            }
+
+            // Od tego miejsca nic już nie zgłasza wyjątków.
+            auto new_list = make_list<k_v_queue_t>();
+
+            for (auto &&restored : order) {
+                if (&*restored.node != &*restored.from) {
+                    new_list.splice(new_list.end(), pair_list, restored.node);
+                } else {
+                    new_list.splice(new_list.end(), snapshot.pair_list, restored.from);
+                }
+            }
+
+            std::swap(iterator_list_map, new_map);
+            std::swap(pair_list, new_list);
+            std::swap(handles, new_handles);
+        }
+
+        // Unieważnia uchwyt elementu it (jeśli jakiś jest) przed jego usunięciem.
+        void forget(k_v_queue_iterator_t it) noexcept {
+            if (it->generation != 0) {
+                handles.erase(it->generation);
+            }
+        }
+
+        // Rejestruje uchwyt; przy wyjątku nic się nie zmienia.
+        typename handles_t::iterator remember(std::uint64_t generation, handle_entry_t entry) {
+            auto inserted = handles.insert({generation, entry}).first;
+            entry.elem->generation = generation;
+
+            return inserted;
+        }
+
+        /**
+         * Unieważnia wszystkie uchwyty, zanim elementy przejdą do innego
+         * kontenera - tam nie mogą odżyć przy kopiowaniu.
+         */
+        void forget_all() noexcept {
+            for (auto &&entry : handles) {
+                entry.second.elem->generation = 0;
+            }
+
+            handles.clear();
         }
 
-        container_t(container_t &&other) noexcept = default;
+        // Pusta lista z węzłami z puli kontenera.
+        template<typename List>
+        List make_list() noexcept {
+            return List(typename List::allocator_type(&pool));
+        }
 
-        ~container_t() noexcept = default;
+        k_v_map_t empty_map() noexcept {
+            return k_v_map_t(pool_alloc_t<typename k_v_map_t::value_type>(&pool));
+        }
 
+        // Przed listami, żeby zniszczyć ją dopiero po nich.
+        kvfifo_detail::node_pool<allocator_type> pool;
         k_v_map_t iterator_list_map;
         k_v_queue_t pair_list;
+        handles_t handles;
+    };
+
+    // Nowy kontener (pusty albo kopia other) w pamięci z alokatora alloc.
+    static std::shared_ptr<container_t> make_container(allocator_type const &alloc) {
+        return new_container(alloc, alloc);
+    }
+
+    static std::shared_ptr<container_t> make_container(container_t const &other, allocator_type const &alloc) {
+        return new_container(alloc, other, alloc);
+    }
+
+    using container_alloc_t = kvfifo_detail::rebind_alloc<allocator_type, container_t>;
+    using container_traits = std::allocator_traits<container_alloc_t>;
+
+    /**
+     * Przy odroczonym niszczeniu shared_ptr dostaje deleter, który oddaje
+     * kontener reclaimerowi polityki - niezależnie od tego, która kopia
+     * i w której operacji puści go ostatnia.
+     */
+    template<typename... Args>
+    static std::shared_ptr<container_t> new_container(allocator_type const &alloc, Args const &...args) {
+        if constexpr (!reclamation_policy::deferred) {
+            return std::allocate_shared<container_t>(alloc, args...);
+        } else {
+            container_alloc_t container_alloc(alloc);
+            container_t *p = container_traits::allocate(container_alloc, 1);
+
+            try {
+                container_traits::construct(container_alloc, p, args...);
+            } catch (...) {
+                container_traits::deallocate(container_alloc, p, 1);
+                throw;
+            }
+
+            p->dispose = &dispose_container;
+
+            // Jeśli zabraknie pamięci na licznik, shared_ptr sam wywoła deleter.
+            return std::shared_ptr<container_t>(
+                p, [](container_t *c) { reclamation_policy::reclaimer().retire(c); }, alloc);
+        }
+    }
+
+    // Woła go reclaimer, często po zniszczeniu kolejki - zasób alokatora musi jeszcze żyć.
+    static void dispose_container(kvfifo_detail::retired_node *node) noexcept {
+        container_t *p = static_cast<container_t *>(node);
+        container_alloc_t container_alloc(allocator_type(p->pool.get_allocator()));
+        container_traits::destroy(container_alloc, p);
+        container_traits::deallocate(container_alloc, p, 1);
+    }
+
+    // Kawałki mniejsze niż to nie opłacają się osobnego wątku.
+    static constexpr std::size_t min_parallel_chunk = 1 << 14;
+
+    static std::size_t chunk_count(std::size_t n, kvfifo_parallel parallel) {
+        // Stanowy alokator nie musi być bezpieczny dla wątków.
+        if constexpr (!allocator_traits::is_always_equal::value) {
+            return 1;
+        }
+
+        std::size_t threads = parallel.threads != 0 ? parallel.threads
+                                                    : std::thread::hardware_concurrency();
+
+        return std::max<std::size_t>(1, std::min(threads, n / min_parallel_chunk));
+    }
+
+    /**
+     * Buduje kontener z kawałków [bounds[i], bounds[i + 1]): każdy kawałek
+     * w osobnym wątku (pierwszy w bieżącym), po czym dokleja je po kolei.
+     */
+    template<typename It>
+    static std::shared_ptr<container_t> build_parallel(std::vector<It> const &bounds, allocator_type const &alloc) {
+        std::size_t chunks = bounds.size() - 1;
+        std::vector<std::optional<container_t>> parts(chunks);
+        std::vector<std::exception_ptr> errors(chunks);
+
+        {
+            std::vector<std::jthread> workers;
+
+            for (std::size_t i = 1; i < chunks; i++) {
+                workers.emplace_back([&parts, &errors, &bounds, &alloc, i]() {
+                    try {
+                        parts[i].emplace(alloc).assign(bounds[i], bounds[i + 1]);
+                    } catch (...) {
+                        errors[i] = std::current_exception();
+                    }
+                });
+            }
+
+            try {
+                parts[0].emplace(alloc).assign(bounds[0], bounds[1]);
+            } catch (...) {
+                errors[0] = std::current_exception();
+            }
+        }
+
+        for (auto const &error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        auto result = make_container(alloc);
+
+        for (std::size_t i = 0; i < chunks; i++) {
+            result->append(*parts[i]);
+        }
+
+        return result;
+    }
+
+    // Wątek jest niszczony pierwszy: przerywa kopiowanie i czeka na jego koniec.
+    struct pending_detach_t {
+        std::shared_ptr<container_t const> source;
+        std::future<std::shared_ptr<container_t>> clone;
+        std::jthread worker;
     };
 
     class copy_guard_t {
     public:
-        explicit copy_guard_t(kvfifo *to_guard) : guarded(to_guard),
-            guarded_data(to_guard->dataPtr),
-            guarded_unshareable(to_guard->unshareable) {}
+        /**
+         * Wewnątrz transaction() wycofaniem zmian zajmuje się strażnik całej
+         * transakcji, więc pojedyncze operacje nie kopiują wskaźnika.
+         */
+        explicit copy_guard_t(basic_kvfifo *to_guard) : guarded(to_guard),
+            guarded_unshareable(to_guard->unshareable),
+            rollback(!to_guard->inTransaction) {
+            if (rollback) {
+                guarded_data = to_guard->dataPtr;
+            }
+        }
 
         ~copy_guard_t() noexcept {
             if (rollback) {
-                std::swap(guarded->dataPtr, guarded_data);
+                if (!restore_in_place()) {
+                    std::swap(guarded->dataPtr, guarded_data);
+                }
+
                 guarded->unshareable = guarded_unshareable;
             }
         }
 
+        /**
+         * Zamiast wskaźnika na dane trzyma ich głęboką kopię, więc dane
+         * zostają tylko nasze i zmieniamy je w miejscu. Wycofanie przywraca
+         * kopię w tym samym kontenerze.
+         */
+        void snapshot() {
+            container_t const &data = *guarded->dataPtr;
+            before.reserve(data.pair_list.size());
+
+            for (auto const &elem : data.pair_list) {
+                before.push_back(&elem);
+            }
+
+            guarded_data = make_container(data, guarded->alloc);
+            original = guarded->dataPtr;
+            deep = true;
+        }
+
         void no_rollback() {
             rollback = false;
         }
 
     private:
-        kvfifo *guarded;
+        /**
+         * Przywraca kopię w kontenerze sprzed transakcji, jeśli kolejka wciąż
+         * go ma i tylko ona. Gdy się nie da (albo przywracanie zgłosi
+         * wyjątek), kolejka dostaje samą kopię, a referencje do wartości
+         * przestają być ważne.
+         */
+        bool restore_in_place() noexcept {
+            std::shared_ptr<container_t> const &data = guarded->dataPtr;
+
+            if (!deep || data == nullptr || data.owner_before(original) || original.owner_before(data) ||
+                !kvfifo_detail::exclusive(data, 1)) {
+                return false;
+            }
+
+            try {
+                data->restore(*guarded_data, before);
+                return true;
+            } catch (...) {
+                return false;
+            }
+        }
+
+        basic_kvfifo *guarded;
         std::shared_ptr<container_t> guarded_data;
+        // Tylko przy głębokiej kopii: kontener, którego dotyczy, i adresy jego węzłów.
+        std::weak_ptr<container_t> original;
+        std::vector<element_t const *> before;
         bool guarded_unshareable;
         bool rollback = true;
+        bool deep = false;
     };
 
+    [[no_unique_address]] allocator_type alloc;
+    [[no_unique_address]] mutable mutex_t mutex;
     bool unshareable = false;
+    bool inTransaction = false;
     std::shared_ptr<container_t> dataPtr;
+    std::unique_ptr<pending_detach_t> pendingDetach;
 };
 
+template<typename K, typename V>
+using kvfifo = basic_kvfifo<K, V>;
+
+/**
+ * Kolejka z pamięcią z std::pmr::memory_resource podanego w konstruktorze.
+ * Nie jest w przestrzeni nazw pmr, żeby nie kolidować z std::pmr po
+ * using namespace std.
+ */
+template<typename K, typename V, typename... Policies>
+using pmr_kvfifo = basic_kvfifo<K, V,
+    kvfifo_policy::with_allocator<std::pmr::polymorphic_allocator<std::byte>>, Policies...>;
+
 #endif
\ No newline at end of file
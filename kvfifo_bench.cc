@@ -0,0 +1,362 @@
+#include "kvfifo.h"
+#include "static_kvfifo.h"
+#include "epoch_kvfifo.h"
+#include "flat_kvfifo.h"
+#include "slab_kvfifo.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using std::cout;
+using std::endl;
+using bench_clock = std::chrono::steady_clock;
+
+namespace {
+    volatile long long sink;
+
+    double us_since(bench_clock::time_point start) {
+        return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+    }
+
+    kvfifo<int, int> make_queue(int n) {
+        kvfifo<int, int> q;
+        for (int i = 0; i < n; i++) {
+            q.push(i % 1024, i);
+        }
+        return q;
+    }
+
+    // Opóźnienie pierwszej modyfikacji kopii: synchronicznie, tuż po
+    // prepare_detach() (czeka na kopiowanie) oraz po odczekaniu tyle, ile
+    // trwało synchroniczne kopiowanie.
+    void detach_latency_bench(int max_exp) {
+        cout << "copy, then mutate once (latency in us)" << endl;
+        cout << "n\tsync pop\tprepare_detach\tpop right after prepare\tpop after prepare and wait" << endl;
+
+        for (int e = 3, n = 1000; e <= max_exp; e++, n *= 10) {
+            kvfifo<int, int> const source = make_queue(n);
+
+            kvfifo<int, int> sync_copy = source;
+            auto start = bench_clock::now();
+            sync_copy.pop();
+            double sync_us = us_since(start);
+
+            kvfifo<int, int> eager_copy = source;
+            eager_copy.prepare_detach();
+            start = bench_clock::now();
+            eager_copy.pop();
+            double eager_us = us_since(start);
+
+            kvfifo<int, int> async_copy = source;
+            start = bench_clock::now();
+            async_copy.prepare_detach();
+            double prepare_us = us_since(start);
+
+            std::this_thread::sleep_for(std::chrono::duration<double, std::micro>(2 * sync_us + 1000));
+
+            start = bench_clock::now();
+            async_copy.pop();
+            double async_us = us_since(start);
+
+            cout << n << "\t" << sync_us << "\t" << prepare_us << "\t" << eager_us << "\t" << async_us << endl;
+        }
+    }
+
+    // Cykle push/pop na kolejce o co najwyżej 16 elementach i 8 kluczach.
+    template<typename Q>
+    double small_queue_churn_ns(int rounds) {
+        Q q;
+        long long checksum = 0;
+        auto start = bench_clock::now();
+
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < 16; i++) {
+                (void) q.push(i % 8, i);
+            }
+            checksum += q.first(r % 8).second;
+            q.pop(r % 8);
+            q.move_to_back((r + 1) % 8);
+            while (!q.empty()) {
+                checksum += q.front().second;
+                q.pop();
+            }
+        }
+
+        double ns = us_since(start) * 1000 / rounds;
+        sink = checksum;
+        return ns;
+    }
+
+    // Średni czas count(k) dla losowych kluczy w kolejce z keys różnymi kluczami.
+    template<typename Q>
+    double key_lookup_ns(int keys) {
+        Q q;
+        for (int i = 0; i < 4 * keys; i++) {
+            q.push(i % keys * 7919, i);
+        }
+
+        int const lookups = 2000000;
+        std::vector<int> order(4096);
+        unsigned state = 12345;
+        for (int &key : order) {
+            state = state * 1103515245 + 12345;
+            key = static_cast<int>(state >> 16) % keys * 7919;
+        }
+
+        long long checksum = 0;
+        auto start = bench_clock::now();
+
+        for (int i = 0; i < lookups; i++) {
+            checksum += q.count(order[i & 4095]);
+        }
+
+        double ns = us_since(start) * 1000 / lookups;
+        sink = checksum;
+        return ns;
+    }
+
+    void key_lookup_bench() {
+        using namespace kvfifo_policy;
+        cout << "count(k) lookup (ns)" << endl;
+        cout << "keys\tordered\thashed\tsmall_index<64>" << endl;
+
+        for (int keys = 1; keys <= 256; keys *= 2) {
+            cout << keys << "\t" << key_lookup_ns<basic_kvfifo<int, int>>(keys)
+                 << "\t" << key_lookup_ns<basic_kvfifo<int, int, hashed_index>>(keys)
+                 << "\t" << key_lookup_ns<basic_kvfifo<int, int, small_index<64>>>(keys) << endl;
+        }
+    }
+
+    // from_range() i clone() na 10^max_exp elementach przy 1..N wątkach;
+    // N to hardware_concurrency(), ale co najmniej 4.
+    void parallel_build_bench(int max_exp) {
+        int n = 1;
+        for (int e = 0; e < max_exp; e++) {
+            n *= 10;
+        }
+
+        std::vector<std::pair<int, int>> items;
+        for (int i = 0; i < n; i++) {
+            items.push_back({i % 1024, i});
+        }
+        kvfifo<int, int> const source = make_queue(n);
+
+        unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+        cout << "parallel build of " << n << " elements (us)" << endl;
+        cout << "threads\tfrom_range\tclone" << endl;
+
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+            auto start = bench_clock::now();
+            auto built = kvfifo<int, int>::from_range(kvfifo_parallel{threads}, items.begin(), items.end());
+            double build_us = us_since(start);
+
+            start = bench_clock::now();
+            auto cloned = source.clone(kvfifo_parallel{threads});
+            double clone_us = us_since(start);
+
+            sink = built.size() + cloned.size();
+            cout << threads << "\t" << build_us << "\t" << clone_us << endl;
+        }
+    }
+
+    // Średni czas move_to_back(k) dla klucza z n elementami (spośród 2n).
+    template<typename Q>
+    double hot_key_move_us(int n) {
+        Q q;
+        for (int i = 0; i < n; i++) {
+            q.push(0, i);
+            q.push(1, i);
+        }
+
+        int const moves = 100;
+        auto start = bench_clock::now();
+
+        for (int i = 0; i < moves; i++) {
+            q.move_to_back(i % 2);
+        }
+
+        double us = us_since(start) / moves;
+        sink = q.front().second;
+        return us;
+    }
+
+    void hot_key_move_bench(int max_exp) {
+        cout << "move_to_back of a hot key (us)" << endl;
+        cout << "count(k)\tkvfifo\tepoch_kvfifo" << endl;
+
+        for (int e = 1, n = 10; e <= max_exp; e++, n *= 10) {
+            cout << n << "\t" << hot_key_move_us<kvfifo<int, int>>(n)
+                 << "\t" << hot_key_move_us<epoch_kvfifo<int, int>>(n) << endl;
+        }
+    }
+
+    // Średni czas zbudowania i zniszczenia kolejki n elementów (w 64 kluczach).
+    template<typename Q, typename... Args>
+    double short_lived_us(int n, int rounds, Args &&...args) {
+        auto start = bench_clock::now();
+
+        for (int r = 0; r < rounds; r++) {
+            Q q(args...);
+            for (int i = 0; i < n; i++) {
+                q.push(i % 64, i);
+            }
+            q.pop();
+            sink = q.size();
+        }
+
+        return us_since(start) / rounds;
+    }
+
+    // Kolejka z pamięcią z areny, zwalnianej w całości po każdej rundzie.
+    double arena_short_lived_us(int n, int rounds) {
+        std::vector<std::byte> buffer(std::size_t(n) * 160 + 65536);
+        std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+        auto start = bench_clock::now();
+
+        for (int r = 0; r < rounds; r++) {
+            {
+                pmr_kvfifo<int, int> q(&arena);
+                for (int i = 0; i < n; i++) {
+                    q.push(i % 64, i);
+                }
+                q.pop();
+                sink = q.size();
+            }
+            arena.release();
+        }
+
+        return us_since(start) / rounds;
+    }
+
+    void short_lived_bench(int max_exp) {
+        cout << "short-lived queue: build n elements and destroy (us)" << endl;
+        cout << "n\tkvfifo\tpmr new_delete\tpmr monotonic arena\tarena_storage" << endl;
+
+        for (int e = 2, n = 100; e <= std::min(max_exp, 5); e++, n *= 10) {
+            int rounds = 1000000 / n;
+            cout << n << "\t" << short_lived_us<kvfifo<int, int>>(n, rounds)
+                 << "\t" << short_lived_us<pmr_kvfifo<int, int>>(n, rounds, std::pmr::new_delete_resource())
+                 << "\t" << arena_short_lived_us(n, rounds)
+                 << "\t" << short_lived_us<basic_kvfifo<int, int, kvfifo_policy::arena_storage>>(n, rounds) << endl;
+        }
+    }
+
+    // Czas, w którym ostatnia kopia puszcza dane (clear()), przy niszczeniu w miejscu i odroczonym.
+    template<typename Q>
+    double drop_us(int n) {
+        Q q;
+        for (int i = 0; i < n; i++) {
+            q.push(i % 1024, i);
+        }
+
+        auto start = bench_clock::now();
+        q.clear();
+        return us_since(start);
+    }
+
+    void drop_latency_bench(int max_exp) {
+        cout << "drop last reference (latency in us)" << endl;
+        cout << "n\tinline\tdeferred\tcollect" << endl;
+
+        for (int e = 3, n = 1000; e <= max_exp; e++, n *= 10) {
+            double inline_us = drop_us<kvfifo<int, int>>(n);
+            double deferred_us = drop_us<basic_kvfifo<int, int, kvfifo_policy::deferred_reclamation>>(n);
+            auto start = bench_clock::now();
+            kvfifo_reclaimer::instance().collect();
+            cout << n << "\t" << inline_us << "\t" << deferred_us << "\t" << us_since(start) << endl;
+        }
+    }
+
+    // Pierwsza modyfikacja kopii, która musi skopiować n elementów.
+    template<typename Q>
+    double detach_us(int n) {
+        Q source;
+        for (int i = 0; i < n; i++) {
+            source.push(i % 1024, i);
+        }
+
+        Q copy = source;
+        auto start = bench_clock::now();
+        copy.pop();
+        return us_since(start);
+    }
+
+    void flat_detach_bench(int max_exp) {
+        cout << "copy, then mutate once (latency in us)" << endl;
+        cout << "n\tkvfifo\tflat_kvfifo" << endl;
+
+        for (int e = 3, n = 1000; e <= max_exp; e++, n *= 10) {
+            cout << n << "\t" << detach_us<kvfifo<int, int>>(n) << "\t" << detach_us<flat_kvfifo<int, int>>(n) << endl;
+        }
+    }
+
+    using big_value = std::array<char, 4096>;
+
+    // Kopia n dużych wartości, jedna modyfikacja kopii, potem obroty kluczami i opróżnienie.
+    template<typename Q>
+    std::pair<double, double> big_value_us(int n) {
+        Q source;
+        for (int i = 0; i < n; i++) {
+            big_value v{};
+            v[0] = char(i);
+            source.push(i % 64, v);
+        }
+
+        Q copy = source;
+        auto start = bench_clock::now();
+        copy.pop();
+        double detach = us_since(start);
+
+        start = bench_clock::now();
+        for (int k = 0; k < 64; k++) {
+            copy.move_to_back(k);
+        }
+        long long sum = 0;
+        while (!copy.empty()) {
+            sum += std::as_const(copy).front().second[0];
+            copy.pop();
+        }
+        sink = sum;
+        return {detach, us_since(start)};
+    }
+
+    void big_value_bench(int max_exp) {
+        cout << "4 KiB values: detach and drain (us)" << endl;
+        cout << "n\tkvfifo detach\tslab detach\tkvfifo drain\tslab drain" << endl;
+
+        for (int e = 3, n = 1000; e <= std::min(max_exp, 5); e++, n *= 10) {
+            auto plain = big_value_us<kvfifo<int, big_value>>(n);
+            auto slab = big_value_us<slab_kvfifo<int, big_value>>(n);
+            cout << n << "\t" << plain.first << "\t" << slab.first << "\t" << plain.second << "\t" << slab.second
+                 << endl;
+        }
+    }
+
+    void small_queue_bench() {
+        int const rounds = 200000;
+        cout << "small queue churn (ns per round of 16 pushes)" << endl;
+        cout << "kvfifo\t" << small_queue_churn_ns<kvfifo<int, int>>(rounds) << endl;
+        cout << "static_kvfifo\t" << small_queue_churn_ns<static_kvfifo<int, int, 16, 8>>(rounds) << endl;
+    }
+}
+
+// Użycie: kvfifo_bench [maksymalny wykładnik rozmiaru kolejki, domyślnie 6]
+int main(int argc, char *argv[]) {
+    int max_exp = argc > 1 ? std::atoi(argv[1]) : 6;
+
+    detach_latency_bench(max_exp);
+    small_queue_bench();
+    key_lookup_bench();
+    parallel_build_bench(max_exp);
+    hot_key_move_bench(max_exp);
+    short_lived_bench(max_exp);
+    drop_latency_bench(max_exp);
+    flat_detach_bench(max_exp);
+    big_value_bench(max_exp);
+}
@@ -2,11 +2,22 @@
 #define KVFIFO_TEST_H_
 
 #include "kvfifo.h"
+#include "static_kvfifo.h"
+#include "async_kvfifo.h"
+#include "blocking_kvfifo.h"
+#include "fair_kvfifo.h"
+#include "epoch_kvfifo.h"
+#include "flat_kvfifo.h"
+#include "slab_kvfifo.h"
 #include <cassert>
 #include <memory>
+#include <memory_resource>
 #include <vector>
 #include <string>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <chrono>
 
 using std::string;
 using std::cout;
@@ -265,6 +276,1303 @@ namespace mkostyk {
         }
     }
 
+    void modify_test() {
+        cout << "Modify test" << endl;
+        kvfifo<string, int> kvf1;
+        kvf1.push("Asterix", 1);
+        kvf1.push("Obelix", 2);
+        kvf1.push("Asterix", 3);
+
+        kvfifo<string, int> kvf2 = kvf1;
+        kvf1.modify_front([](int &v) { v = 10; });
+        kvf1.modify_back([](int &v) { v = 30; });
+        kvf1.update("Obelix", [](int &v) { v = 20; });
+
+        // Odczyty przez stałą referencję nie blokują współdzielenia.
+        auto const &ckvf1 = std::as_const(kvf1);
+        assert(ckvf1.front().second == 10 && ckvf1.back().second == 30);
+        assert(ckvf1.first("Obelix").second == 20);
+        assert(std::as_const(kvf2).front().second == 1 && std::as_const(kvf2).back().second == 3);
+
+        // Po modify_* kopia nadal współdzieli dane (te same adresy wartości),
+        // więc modyfikacja oryginału musi ją odłączyć.
+        kvfifo<string, int> const kvf3 = kvf1;
+        assert(&kvf3.front().second == &ckvf1.front().second);
+        assert(&kvf3.first("Obelix").second == &ckvf1.first("Obelix").second);
+        kvf1.update_last("Asterix", [](int &v) { v = 33; });
+        assert(&kvf3.front().second != &ckvf1.front().second);
+        assert(ckvf1.last("Asterix").second == 33);
+        assert(kvf3.last("Asterix").second == 30);
+
+        // Wyjątek w fn na współdzielonych danych niczego nie zmienia.
+        kvfifo<string, int> kvf4 = kvf3;
+        try {
+            kvf4.modify_front([](int &v) { v = 0; throw std::runtime_error("fn"); });
+            assert(false);
+        } catch (std::runtime_error &e) {}
+        assert(kvf3.front().second == 10 && kvf4.front().second == 10);
+
+        try {
+            kvf1.update("Idefix", [](int &) {});
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+    }
+
+    void prepare_detach_test() {
+        cout << "Prepare detach test" << endl;
+        kvfifo<int, int> kvf1;
+        for (int i = 0; i < 10000; i++) {
+            kvf1.push(i % 100, i);
+        }
+
+        kvfifo<int, int> kvf2 = kvf1;
+        kvf2.prepare_detach();
+        // Odczyty nie czekają na kopię i widzą wspólne dane.
+        assert(kvf2.size() == 10000 && kvf2.count(7) == 100);
+        kvf2.pop();
+        kvf2.push(7, -1);
+        assert(kvf2.size() == 10000 && kvf2.count(0) == 99 && kvf2.count(7) == 101);
+        assert(kvf1.size() == 10000 && kvf1.count(0) == 100 && kvf1.count(7) == 100);
+
+        // Kopia przygotowana dla innych danych nie może zostać użyta.
+        kvfifo<int, int> kvf3 = kvf1;
+        kvf3.prepare_detach();
+        kvf3 = kvf2;
+        kvf3.pop(7);
+        assert(kvf3.size() == 9999 && kvf2.size() == 10000 && kvf1.size() == 10000);
+
+        // Porzucone przygotowania przerywają kopiowanie i czekają na swoje wątki.
+        {
+            std::vector<kvfifo<int, int>> copies(64, kvf1);
+            for (auto &copy : copies) {
+                copy.prepare_detach();
+            }
+            copies[0].pop();
+            assert(copies[0].size() == 9999 && copies[1].size() == 10000);
+        }
+        assert(kvf1.size() == 10000 && kvf1.count(0) == 100);
+
+        // Niewspółdzielone dane nie są kopiowane.
+        kvfifo<int, int> kvf4;
+        kvf4.prepare_detach();
+        kvf4.push(1, 1);
+        kvf4.prepare_detach();
+        assert(kvf4.size() == 1);
+    }
+
+    void transaction_test() {
+        cout << "Transaction test" << endl;
+        kvfifo<string, int> kvf1;
+        kvf1.push("Asterix", 1);
+        kvf1.push("Obelix", 2);
+        kvf1.push("Asterix", 3);
+        kvfifo<string, int> const kvf2 = kvf1;
+
+        kvf1.transaction([](kvfifo<string, int> &q) {
+            q.pop("Asterix");
+            q.pop("Asterix");
+            q.push("Idefix", 4);
+            q.move_to_back("Obelix");
+        });
+        assert(kvf1.size() == 2 && kvf1.count("Asterix") == 0);
+        assert(kvf1.front().first == "Idefix" && kvf1.back().first == "Obelix");
+        assert(kvf2.size() == 3 && kvf2.count("Asterix") == 2);
+
+        // Wyjątek wycofuje wszystkie zmiany, również z zagnieżdżonej transakcji.
+        try {
+            kvf1.transaction([](kvfifo<string, int> &q) {
+                q.pop();
+                q.transaction([](kvfifo<string, int> &inner) {
+                    inner.push("Panoramix", 5);
+                });
+                q.clear();
+                q.pop("Idefix");
+            });
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+        assert(kvf1.size() == 2 && kvf1.count("Panoramix") == 0);
+        assert(kvf1.front().first == "Idefix" && kvf1.back().first == "Obelix");
+
+        // Niewspółdzielona kolejka również musi zostać przywrócona.
+        kvfifo<string, int> kvf3;
+        kvf3.push("Asterix", 1);
+        try {
+            kvf3.transaction([](kvfifo<string, int> &q) {
+                q.modify_front([](int &v) { v = 2; });
+                q.push("Obelix", 2);
+                throw std::runtime_error("rollback");
+            });
+            assert(false);
+        } catch (std::runtime_error &e) {}
+        assert(kvf3.size() == 1 && kvf3.front().second == 1);
+
+        // Referencje sprzed transakcji pozostają ważne po zatwierdzeniu i po wycofaniu.
+        kvfifo<int, int> kvf4;
+        kvf4.push(1, 1);
+        kvf4.push(2, 2);
+        int &first = kvf4.front().second;
+        int &last = kvf4.back().second;
+        auto h = kvf4.push_with_handle(2, 5);
+        kvf4.transaction([](kvfifo<int, int> &q) {
+            q.push(3, 3);
+        });
+        first = 7;
+        assert(kvf4.front().second == 7 && kvf4.size() == 4);
+        try {
+            kvf4.transaction([&h](kvfifo<int, int> &q) {
+                q.front().second = 8;
+                q.move_to_back(1);
+                q.pop(3);
+                q.erase(h);
+                q.push(4, 4);
+                throw std::runtime_error("rollback");
+            });
+            assert(false);
+        } catch (std::runtime_error &e) {}
+        first = 9;
+        last = 10;
+        assert(kvf4.size() == 4 && kvf4.count(4) == 0 && kvf4.valid(h) && kvf4.value(h) == 5);
+        assert(kvf4.front().second == 9 && kvf4.first(2).second == 10 && kvf4.back().second == 3);
+        kvf4.erase(h);
+        assert(kvf4.count(2) == 1 && !kvf4.valid(h));
+    }
+
+    template<typename Q>
+    void policy_queue_test() {
+        Q kvf1;
+        for (int i = 0; i < 100; i++) {
+            kvf1.push(i % 7, i);
+        }
+
+        Q kvf2 = kvf1;
+        kvf1.pop(3);
+        kvf1.move_to_back(0);
+        kvf1.pop();
+        assert(kvf1.size() == 98 && kvf1.count(3) == 13 && kvf1.count(1) == 14);
+        assert(kvf1.front().first == 2 && kvf1.back().first == 0 && kvf1.back().second == 98);
+        assert(kvf2.size() == 100 && kvf2.count(3) == 14 && kvf2.front().first == 0);
+
+        int keys = 0;
+        for (auto it = kvf1.k_begin(); it != kvf1.k_end(); ++it) {
+            assert(*it >= 0 && *it < 7);
+            keys++;
+        }
+        assert(keys == 7);
+
+        kvf1.clear();
+        assert(kvf1.empty() && kvf1.k_begin() == kvf1.k_end() && kvf2.size() == 100);
+    }
+
+    void policy_test() {
+        cout << "Policy test" << endl;
+        using namespace kvfifo_policy;
+        policy_queue_test<basic_kvfifo<int, int>>();
+        policy_queue_test<basic_kvfifo<int, int, hashed_index>>();
+        policy_queue_test<basic_kvfifo<int, int, sorted_vector_index>>();
+        policy_queue_test<basic_kvfifo<int, int, unique_sharing>>();
+        policy_queue_test<basic_kvfifo<int, int, dense_index<0, 127>>>();
+        policy_queue_test<basic_kvfifo<int, int, dense_index<-3, 6>>>();
+        policy_queue_test<basic_kvfifo<int, int, small_index<>>>();
+        policy_queue_test<basic_kvfifo<int, int, small_index<4>>>();
+        policy_queue_test<basic_kvfifo<int, int, small_index<3, hashed_index>>>();
+        policy_queue_test<basic_kvfifo<int, int, mutex_locking, sorted_vector_index>>();
+        static_assert(std::is_same_v<kvfifo<int, int>, basic_kvfifo<int, int>>);
+        static_assert(std::is_nothrow_move_constructible_v<kvfifo<int, int>>);
+        static_assert(!noexcept(std::declval<basic_kvfifo<int, int, mutex_locking> const &>().size()));
+
+        basic_kvfifo<int, int, dense_index<-100, 100>> dense;
+        for (int k : {100, -100, 5, 70, 64, 63, -37}) {
+            dense.push(k, k);
+        }
+        try {
+            dense.push(101, 0);
+            assert(false);
+        } catch (std::out_of_range &e) {}
+        assert(dense.size() == 7 && dense.count(101) == 0 && dense.back().first == -37);
+        int expected[] = {-100, -37, 5, 63, 64, 70, 100};
+        auto dense_it = dense.k_begin();
+        for (int k : expected) {
+            assert(*dense_it++ == k);
+        }
+        assert(dense_it == dense.k_end());
+        for (int k : {100, 70, 64, 63, 5, -37, -100}) {
+            assert(*--dense_it == k);
+        }
+        dense.pop(63);
+        dense.pop(-100);
+        assert(*dense.k_begin() == -37 && *std::next(dense.k_begin(), 2) == 64);
+
+        // Przejście na drzewo i z powrotem, klucze 64-bitowe i napisy.
+        basic_kvfifo<long long, int, small_index<8>> small;
+        for (int i = 0; i < 20; i++) {
+            small.push(1000000000000LL * (i % 10), i);
+        }
+        assert(small.count(9000000000000LL) == 2 && small.first(3000000000000LL).second == 3);
+        for (int i = 0; i < 20; i++) {
+            small.pop();
+        }
+        small.push(5, 5);
+        assert(small.count(5) == 1 && *small.k_begin() == 5);
+
+        basic_kvfifo<string, int, small_index<2>> small_strings;
+        for (string key : {"c", "a", "b", "a"}) {
+            small_strings.push(key, 0);
+        }
+        assert(small_strings.count("a") == 2 && *small_strings.k_begin() == "a");
+
+        basic_kvfifo<int, int, mutex_locking> shared;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&shared, t]() {
+                for (int i = 0; i < 1000; i++) {
+                    shared.push(t, i);
+                    basic_kvfifo<int, int, mutex_locking> copy = shared;
+                    assert(copy.count(t) > 0);
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        assert(shared.size() == 4000 && shared.count(2) == 1000);
+    }
+
+    constexpr int static_kvfifo_constexpr() {
+        static_kvfifo<int, int, 4, 2> kvf;
+        (void) kvf.push(1, 1);
+        (void) kvf.push(2, 2);
+        (void) kvf.push(1, 3);
+        kvf.move_to_back(1);
+        kvf.pop();
+        return kvf.front().second * 10 + static_cast<int>(kvf.size());
+    }
+
+    void static_kvfifo_test() {
+        cout << "Static kvfifo test" << endl;
+        static_assert(static_kvfifo_constexpr() == 12);
+
+        static_kvfifo<string, int, 5, 2> kvf1;
+        assert(kvf1.push("Asterix", 1) && kvf1.push("Obelix", 2) && kvf1.push("Asterix", 3));
+        assert(!kvf1.push("Idefix", 4)); // Za dużo kluczy.
+        assert(kvf1.size() == 3 && kvf1.count("Idefix") == 0);
+        assert(kvf1.push("Obelix", 4) && kvf1.push("Obelix", 5));
+        assert(!kvf1.push("Obelix", 6)); // Za dużo elementów.
+
+        auto kvf2 = kvf1;
+        kvf1.move_to_back("Asterix");
+        assert(kvf1.front().first == "Obelix" && kvf1.back().second == 3);
+        assert(kvf1.first("Asterix").second == 1 && kvf1.last("Obelix").second == 5);
+        kvf1.pop("Obelix");
+        kvf1.pop();
+        assert(kvf1.size() == 3 && kvf1.count("Obelix") == 1 && kvf1.front().second == 5);
+        kvf1.front().second = 50;
+        assert(kvf1.first("Obelix").second == 50 && kvf2.last("Obelix").second == 5);
+
+        auto it = kvf2.k_begin();
+        assert(*it == "Asterix" && *++it == "Obelix" && ++it == kvf2.k_end());
+
+        kvf1.pop();
+        kvf1.pop();
+        kvf1.pop();
+        assert(kvf1.empty() && kvf1.k_begin() == kvf1.k_end());
+        try {
+            kvf1.pop();
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+
+        kvf2.clear();
+        for (int i = 0; i < 5; i++) {
+            assert(kvf2.push(i % 2 ? "Asterix" : "Obelix", i));
+        }
+        assert(kvf2.count("Obelix") == 3 && kvf2.last("Asterix").second == 3);
+
+        // pop() i clear() zwalniają zasoby usuniętych elementów i kluczy.
+        auto value = std::make_shared<int>(7);
+        auto key = std::make_shared<int>(1);
+        static_kvfifo<std::shared_ptr<int>, std::shared_ptr<int>, 4> kvf3;
+        assert(kvf3.push(key, value) && kvf3.push(nullptr, value));
+        assert(value.use_count() == 3 && key.use_count() == 3);
+        kvf3.pop();
+        assert(value.use_count() == 2 && key.use_count() == 1);
+        kvf3.clear();
+        assert(value.use_count() == 1 && kvf3.empty());
+        assert(kvf3.push(key, value) && kvf3.size() == 1 && kvf3.count(nullptr) == 0);
+    }
+
+    void append_test() {
+        cout << "Append test" << endl;
+        kvfifo<string, int> kvf1, kvf2;
+        kvf1.push("Asterix", 1);
+        kvf1.push("Obelix", 2);
+        kvf2.push("Obelix", 3);
+        kvf2.push("Idefix", 4);
+        kvf2.push("Asterix", 5);
+
+        kvfifo<string, int> const kvf1_copy = kvf1;
+        kvfifo<string, int> const kvf2_copy = kvf2;
+
+        // Dane obu kolejek są współdzielone, więc nic nie może się zmienić w kopiach.
+        kvf1.append(std::move(kvf2));
+        assert(kvf2.empty() && kvf1.size() == 5);
+        assert(kvf1.back().second == 5 && kvf1.first("Obelix").second == 2 &&
+               kvf1.last("Obelix").second == 3 && kvf1.count("Idefix") == 1);
+        assert(kvf1_copy.size() == 2 && kvf2_copy.size() == 3);
+
+        // Niewspółdzielone dane są przepinane - referencje pozostają ważne.
+        kvfifo<string, int> kvf3;
+        kvf3.push("Panoramix", 6);
+        int &ref = kvf3.front().second;
+        kvf1.append(std::move(kvf3));
+        ref = 60;
+        assert(kvf1.last("Panoramix").second == 60 && kvf1.size() == 6);
+
+        kvf1.pop("Panoramix");
+        kvf1.append(kvf2_copy);
+        assert(kvf1.size() == 8 && kvf2_copy.size() == 3 && kvf1.count("Asterix") == 3);
+        kvf1.append(kvf1);
+        assert(kvf1.size() == 16 && kvf1.last("Idefix").second == 4);
+
+        kvfifo<string, int> kvf4;
+        kvf4.append(kvf2_copy);
+        kvf4.pop();
+        assert(kvf4.size() == 2 && kvf2_copy.size() == 3);
+
+        auto it = kvf1.k_begin();
+        assert(*it++ == "Asterix" && *it++ == "Idefix" && *it++ == "Obelix" && it == kvf1.k_end());
+    }
+
+    template<typename Q>
+    void erase_queue_test() {
+        Q kvf1;
+        for (int i = 0; i < 100; i++) {
+            kvf1.push(i % 10, i);
+        }
+        Q const kvf1_copy = kvf1;
+
+        assert(kvf1.pop_all(3) == 10 && kvf1.pop_all(3) == 0 && kvf1.pop_all(42) == 0);
+        assert(kvf1.size() == 90 && kvf1.count(3) == 0 && kvf1_copy.count(3) == 10);
+
+        // Nieparzyste wartości oraz cały klucz 4 (wartości 4, 14, ..., 94).
+        std::size_t removed = kvf1.erase_if([](int k, int v) { return v % 2 == 1 || k == 4; });
+        assert(removed == 50 && kvf1.size() == 40 && kvf1.count(4) == 0 && kvf1.count(2) == 10);
+        assert(kvf1.first(2).second == 2 && kvf1.last(8).second == 98 && kvf1.front().second == 0);
+        assert(kvf1_copy.size() == 100 && kvf1_copy.first(4).second == 4);
+
+        int expected = 0;
+        for (auto it = kvf1.k_begin(); it != kvf1.k_end(); ++it) {
+            assert(*it % 2 == 0 && *it != 4);
+            expected++;
+        }
+        assert(expected == 4);
+
+        // Wyjątek z pred nie zmienia kolejki.
+        int calls = 0;
+        try {
+            kvf1.erase_if([&calls](int, int) {
+                if (++calls == 20) {
+                    throw std::runtime_error("pred");
+                }
+                return true;
+            });
+            assert(false);
+        } catch (std::runtime_error &e) {}
+        assert(kvf1.size() == 40 && calls == 20);
+
+        assert(kvf1.erase_if([](int, int) { return false; }) == 0);
+        assert(kvf1.erase_if([](int, int) { return true; }) == 40 && kvf1.empty());
+        assert(kvf1.erase_if([](int, int) { return true; }) == 0);
+    }
+
+    void erase_test() {
+        cout << "Erase test" << endl;
+        using namespace kvfifo_policy;
+        erase_queue_test<kvfifo<int, int>>();
+        erase_queue_test<basic_kvfifo<int, int, hashed_index>>();
+        erase_queue_test<basic_kvfifo<int, int, sorted_vector_index>>();
+        erase_queue_test<basic_kvfifo<int, int, small_index<4>>>();
+        erase_queue_test<basic_kvfifo<int, int, dense_index<0, 9>>>();
+
+        kvfifo<int, int> kvf1;
+        kvf1.push(1, 10);
+        kvf1.push(2, 20);
+        kvf1.push(1, 11);
+        kvfifo<int, int> const kvf2 = kvf1;
+        kvf1.transaction([](kvfifo<int, int> &q) {
+            assert(q.erase_if([](int k, int) { return k == 1; }) == 2);
+        });
+        assert(kvf1.size() == 1 && kvf1.front().second == 20 && kvf2.size() == 3);
+    }
+
+    void handle_test() {
+        cout << "Handle test" << endl;
+        kvfifo<string, int> kvf1;
+        kvf1.push("Asterix", 1);
+        auto h1 = kvf1.push_with_handle("Obelix", 2);
+        auto h2 = kvf1.push_with_handle("Asterix", 3);
+        auto h3 = kvf1.push_with_handle("Obelix", 4);
+        kvf1.push("Asterix", 5);
+
+        assert(kvf1.valid(h1) && kvf1.valid(h2) && !kvf1.valid(kvfifo<string, int>::handle()));
+        kvfifo<string, int> const &ckvf1 = kvf1;
+        assert(ckvf1.value(h2) == 3);
+
+        // Usunięcie środkowego elementu klucza.
+        kvf1.erase(h2);
+        assert(!kvf1.valid(h2) && kvf1.size() == 4 && kvf1.count("Asterix") == 2);
+        assert(kvf1.first("Asterix").second == 1 && kvf1.last("Asterix").second == 5);
+        try {
+            kvf1.erase(h2);
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+
+        kvf1.move_to_back(h1);
+        assert(ckvf1.back().second == 2 && ckvf1.first("Obelix").second == 4 && ckvf1.last("Obelix").second == 2);
+
+        // Odłączenie od kopii zachowuje uchwyty w obu kopiach.
+        kvfifo<string, int> kvf2 = kvf1;
+        kvf1.value(h1) = 20;
+        assert(kvf1.last("Obelix").second == 20 && kvf2.last("Obelix").second == 2);
+        kvf1.erase(h1);
+        assert(kvf1.size() == 3 && kvf1.count("Obelix") == 1 && kvf2.size() == 4);
+        assert(kvf1.valid(h3) && std::as_const(kvf1).value(h3) == 4);
+        assert(kvf2.valid(h1) && kvf2.valid(h3) && std::as_const(kvf2).value(h3) == 4);
+        kvf2.pop();
+        kvf2.move_to_back(h3);
+        assert(std::as_const(kvf2).back().second == 4 && std::as_const(kvf2).first("Obelix").second == 2);
+
+        // Transakcja kopiuje dane, a wycofana zostawia uchwyty ważne.
+        try {
+            kvf1.transaction([&](kvfifo<string, int> &q) {
+                q.erase(h3);
+                assert(!q.valid(h3));
+                throw std::runtime_error("rollback");
+            });
+            assert(false);
+        } catch (std::runtime_error &e) {}
+        assert(kvf1.valid(h3) && std::as_const(kvf1).value(h3) == 4);
+        kvf1.erase(h3);
+        assert(kvf1.count("Obelix") == 0 && kvf2.valid(h3));
+
+        // Elementy doklejone do niepustej kolejki tracą uchwyty, także w kopiach.
+        kvfifo<string, int> kvf5;
+        kvf5.push("Idefix", 9);
+        auto h8 = kvf2.push_with_handle("Idefix", 8);
+        kvf5.append(std::move(kvf2));
+        kvfifo<string, int> kvf6 = kvf5;
+        kvf6.pop();
+        assert(kvf6.size() == 4 && kvf6.last("Idefix").second == 8);
+        assert(!kvf5.valid(h8) && !kvf6.valid(h8) && !kvf6.valid(h3));
+
+        // pop() i clear() unieważniają uchwyty.
+        kvfifo<int, int> kvf3;
+        auto h4 = kvf3.push_with_handle(1, 1);
+        auto h5 = kvf3.push_with_handle(1, 2);
+        auto h6 = kvf3.push_with_handle(2, 3);
+        kvf3.pop();
+        assert(!kvf3.valid(h4) && kvf3.valid(h5));
+        kvf3.erase_if([](int k, int) { return k == 2; });
+        assert(!kvf3.valid(h6));
+        auto h7 = kvf3.push_with_handle(2, 3);
+        kvf3.erase(h5);
+        kvf3.erase(h7);
+        assert(kvf3.empty());
+        h7 = kvf3.push_with_handle(1, 1);
+        kvf3.clear();
+        assert(!kvf3.valid(h7));
+    }
+
+    kvfifo_task async_consumer(async_kvfifo<string, int> &kvf, std::vector<int> &got, int n) {
+        for (int i = 0; i < n; i++) {
+            auto [k, v] = co_await kvf.pop_async();
+            got.push_back(v);
+        }
+    }
+
+    kvfifo_task async_key_consumer(async_kvfifo<string, int> &kvf, string key, std::vector<int> &got) {
+        auto [k, v] = co_await kvf.pop_async(key);
+        assert(k == key);
+        got.push_back(v);
+    }
+
+    void async_test() {
+        cout << "Async test" << endl;
+        kvfifo_executor executor;
+        async_kvfifo<string, int> kvf(executor);
+        std::vector<int> got, got_b;
+
+        kvf.push("Asterix", 1);
+        async_consumer(kvf, got, 3).start(executor);
+        async_key_consumer(kvf, "Obelix", got_b).start(executor);
+        executor.run();
+        assert(got == std::vector<int>({1}) && kvf.empty() && kvf.waiting() == 2);
+
+        // Element trafia do najdłużej czekającego pasującego konsumenta,
+        // ale konsument rusza dopiero w run().
+        kvf.push("Obelix", 2);
+        assert(got.size() == 1 && kvf.empty() && !executor.idle());
+        executor.run();
+        kvf.push("Obelix", 3);
+        executor.run();
+        assert(got == std::vector<int>({1, 2}) && got_b == std::vector<int>({3}));
+
+        kvf.push("Idefix", 4);
+        kvf.push("Idefix", 5);
+        executor.run();
+        assert(got == std::vector<int>({1, 2, 4}) && kvf.waiting() == 0 && kvf.count("Idefix") == 1);
+
+        // Element dla klucza jest już w kolejce - bez wstrzymywania.
+        async_key_consumer(kvf, "Idefix", got_b).start(executor);
+        assert(executor.run() == 1 && got_b == std::vector<int>({3, 5}) && kvf.empty());
+
+        // Nieuruchomiony konsument nie czeka.
+        {
+            auto task = async_consumer(kvf, got, 1);
+        }
+        kvf.push("Asterix", 6);
+        assert(kvf.size() == 1 && executor.idle());
+    }
+
+    void blocking_test() {
+        cout << "Blocking test" << endl;
+        using namespace std::chrono_literals;
+        blocking_kvfifo<int, int> kvf;
+
+        kvf.push(1, 10);
+        assert(kvf.wait_pop() == std::make_pair(1, 10));
+        assert(!kvf.wait_pop_for(1ms).has_value() && !kvf.wait_pop_for(7, 1ms).has_value());
+        assert(kvf.waiting() == 0);
+
+        // Element innego klucza nie budzi czekającego i zostaje w kolejce.
+        kvf.push(2, 20);
+        assert(!kvf.wait_pop_for(3, 1ms).has_value() && kvf.count(2) == 1);
+        assert(kvf.wait_pop_until(2, std::chrono::steady_clock::now() + 1ms)->second == 20);
+
+        // Każdy wątek czeka na swój klucz.
+        int const workers = 4, per_worker = 100;
+        std::vector<long long> sums(workers);
+        std::vector<std::thread> threads;
+        for (int w = 0; w < workers; w++) {
+            threads.emplace_back([&kvf, &sums, w]() {
+                for (int i = 0; i < per_worker; i++) {
+                    auto [k, v] = kvf.wait_pop(w);
+                    assert(k == w);
+                    sums[w] += v;
+                }
+            });
+        }
+        for (int i = 0; i < per_worker; i++) {
+            for (int w = 0; w < workers; w++) {
+                kvf.push(w, i);
+            }
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        for (long long sum : sums) {
+            assert(sum == per_worker * (per_worker - 1) / 2);
+        }
+        assert(kvf.empty() && kvf.waiting() == 0);
+    }
+
+    template<typename Q>
+    string fair_order(Q &kvf) {
+        string order;
+        while (!kvf.empty()) {
+            assert(kvf.front_fair().second == kvf.first(kvf.front_fair().first).second);
+            order += kvf.front_fair().first;
+            kvf.pop_fair();
+        }
+        return order;
+    }
+
+    void fair_test() {
+        cout << "Fair test" << endl;
+        fair_kvfifo<char, int> kvf1;
+        for (int i = 0; i < 5; i++) {
+            kvf1.push('a', i);
+        }
+        kvf1.push('b', 0);
+        kvf1.push('b', 1);
+        kvf1.push('c', 0);
+        kvf1.push('c', 1);
+        kvf1.push('c', 2);
+
+        fair_kvfifo<char, int> kvf2 = kvf1;
+        fair_kvfifo<char, int> kvf3 = kvf1;
+        assert(kvf1.active_keys() == 3);
+        assert(fair_order(kvf1) == "abcabcaca" + string("a"));
+        assert(kvf1.active_keys() == 0 && kvf2.size() == 10);
+
+        // Waga 2: klucz a dostaje dwa zdjęcia na obrót pierścienia.
+        kvf2.set_weight('a', 2);
+        assert(kvf2.weight('a') == 2 && kvf2.weight('b') == 1);
+        assert(fair_order(kvf2) == "aabcaabcac");
+
+        // Nowy klucz trafia na koniec bieżącego obrotu; pop() i pop(k) też
+        // zdejmują klucze z pierścienia.
+        kvf3.pop_fair();
+        kvf3.push('d', 0);
+        kvf3.pop('b');
+        kvf3.pop('b');
+        kvf3.pop();
+        assert(kvf3.active_keys() == 3 && kvf3.size() == 7);
+        fair_kvfifo<char, int> kvf4 = std::move(kvf3);
+        assert(kvf3.empty() && kvf3.active_keys() == 0);
+        kvf3.push('e', 0);
+        assert(fair_order(kvf3) == "e");
+        assert(fair_order(kvf4) == "cadcaca");
+
+        try {
+            kvf4.pop_fair();
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+        try {
+            kvf4.set_weight('a', 0);
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+
+        // swap() przepina dane bez kopiowania - wydane referencje zostają ważne.
+        kvfifo<int, int> kvf5, kvf6;
+        kvf5.push(1, 1);
+        int &ref = kvf5.front().second;
+        kvf6.push(2, 2);
+        swap(kvf5, kvf6);
+        ref = 10;
+        assert(std::as_const(kvf6).front().second == 10 && std::as_const(kvf5).front().first == 2);
+        static_assert(noexcept(kvf5.swap(kvf6)) && std::is_nothrow_move_constructible_v<fair_kvfifo<int, int>>);
+
+        // Przy różnych alokatorach swap() kopiuje elementy do pamięci drugiej kolejki.
+        std::pmr::unsynchronized_pool_resource pool;
+        pmr_kvfifo<int, int> kvf7(&pool), kvf8(std::pmr::new_delete_resource());
+        kvf7.push(7, 7);
+        kvf7.swap(kvf8);
+        assert(kvf7.empty() && kvf8.size() == 1 && kvf8.get_allocator().resource() == std::pmr::new_delete_resource());
+    }
+
+    // Losowe operacje na kvfifo i epoch_kvfifo muszą dawać tę samą kolejność.
+    void epoch_test() {
+        cout << "Epoch test" << endl;
+        kvfifo<int, int> reference;
+        epoch_kvfifo<int, int> kvf;
+        unsigned state = 2024;
+
+        for (int i = 0; i < 20000; i++) {
+            state = state * 1103515245 + 12345;
+            int op = (state >> 16) % 10, k = (state >> 8) % 8;
+
+            if (op < 5) {
+                reference.push(k, i);
+                kvf.push(k, i);
+            } else if (op < 7 && !reference.empty()) {
+                reference.pop();
+                kvf.pop();
+            } else if (op < 8 && reference.count(k) > 0) {
+                reference.pop(k);
+                kvf.pop(k);
+            } else if (reference.count(k) > 0) {
+                reference.move_to_back(k);
+                kvf.move_to_back(k);
+            }
+
+            kvfifo<int, int> const &cref = reference;
+            epoch_kvfifo<int, int> const &ckvf = kvf;
+            assert(ckvf.size() == cref.size() && ckvf.count(k) == cref.count(k));
+            if (!cref.empty()) {
+                assert(ckvf.front().second == cref.front().second && ckvf.back().second == cref.back().second);
+            }
+            if (cref.count(k) > 0) {
+                assert(ckvf.first(k).second == cref.first(k).second && ckvf.last(k).second == cref.last(k).second);
+            }
+        }
+
+        epoch_kvfifo<int, int> copy = kvf;
+        copy.front().second = -1;
+        while (!kvf.empty()) {
+            assert(kvf.front().second == reference.front().second);
+            kvf.pop();
+            reference.pop();
+            copy.pop();
+        }
+        assert(copy.empty() && kvf.k_begin() == kvf.k_end());
+
+        try {
+            kvf.move_to_back(1);
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+    }
+
+    void flat_test() {
+        cout << "Flat test" << endl;
+        kvfifo<int, int> reference;
+        flat_kvfifo<int, int> kvf;
+        std::vector<flat_kvfifo<int, int>> snapshots;
+        std::vector<kvfifo<int, int>> reference_snapshots;
+        unsigned state = 2025;
+
+        for (int i = 0; i < 30000; i++) {
+            state = state * 1103515245 + 12345;
+            int op = (state >> 16) % 10, k = (state >> 8) % 16;
+
+            if (op < 6) {
+                reference.push(k, i);
+                kvf.push(k, i);
+            } else if (op < 7 && !reference.empty()) {
+                reference.pop();
+                kvf.pop();
+            } else if (op < 8 && reference.count(k) > 0) {
+                reference.pop(k);
+                kvf.pop(k);
+            } else if (reference.count(k) > 0) {
+                reference.move_to_back(k);
+                kvf.move_to_back(k);
+            }
+
+            // Kopie współdzielą dane, a odłączona kopia zachowuje stan z chwili kopiowania.
+            if (i % 5000 == 0) {
+                snapshots.push_back(kvf);
+                reference_snapshots.push_back(reference);
+            }
+
+            kvfifo<int, int> const &cref = reference;
+            flat_kvfifo<int, int> const &ckvf = kvf;
+            assert(ckvf.size() == cref.size() && ckvf.count(k) == cref.count(k));
+            if (!cref.empty()) {
+                assert(ckvf.front().second == cref.front().second && ckvf.back().second == cref.back().second);
+            }
+            if (cref.count(k) > 0) {
+                assert(ckvf.first(k).second == cref.first(k).second && ckvf.last(k).second == cref.last(k).second);
+            }
+        }
+
+        assert(kvf.size() > 2 * kvf.chunk_nodes);
+        for (std::size_t s = 0; s < snapshots.size(); s++) {
+            assert(std::equal(snapshots[s].k_begin(), snapshots[s].k_end(),
+                              reference_snapshots[s].k_begin(), reference_snapshots[s].k_end()));
+            while (!snapshots[s].empty()) {
+                assert(snapshots[s].front().second == reference_snapshots[s].front().second);
+                snapshots[s].pop();
+                reference_snapshots[s].pop();
+            }
+        }
+
+        // Po wydaniu referencji kopia od razu dostaje własne dane.
+        flat_kvfifo<int, int> copy = kvf;
+        int &value = kvf.front().second;
+        flat_kvfifo<int, int> unshared = kvf;
+        value = -1;
+        assert(unshared.front().second != -1 && copy.front().second != -1 && kvf.front().second == -1);
+
+        while (!kvf.empty()) {
+            kvf.pop();
+            reference.pop();
+        }
+        assert(kvf.k_begin() == kvf.k_end() && copy.size() == unshared.size());
+        copy.clear();
+        unshared.clear();
+        kvf.push(1, 1);
+        assert(copy.empty() && kvf.size() == 1 && kvf.first(1).second == 1);
+
+        // Odłączenie po clear() kopiuje tylko używane kawałki.
+        for (int i = 0; i < 5000; i++) {
+            copy.push(i % 3, i);
+        }
+        copy.clear();
+        copy.push(2, 7);
+        unshared = copy;
+        copy.first(2).second = 8;
+        copy.push(3, 9);
+        assert(unshared.size() == 1 && unshared.front().second == 7 && copy.size() == 2 && copy.back().second == 9);
+
+        try {
+            kvf.pop(2);
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+        flat_kvfifo<int, int> none;
+        assert(none.k_begin() == none.k_end() && none.count(1) == 0);
+    }
+
+    void slab_test() {
+        cout << "Slab test" << endl;
+        kvfifo<int, string> reference;
+        slab_kvfifo<int, string> kvf;
+        std::vector<slab_kvfifo<int, string>> snapshots;
+        std::vector<kvfifo<int, string>> reference_snapshots;
+        unsigned state = 2026;
+
+        for (int i = 0; i < 20000; i++) {
+            state = state * 1103515245 + 12345;
+            int op = (state >> 16) % 10, k = (state >> 8) % 16;
+            string v = std::to_string(i) + string(40, 'v');
+
+            if (op < 5) {
+                reference.push(k, v);
+                kvf.push(k, v);
+            } else if (op < 7 && !reference.empty()) {
+                reference.pop();
+                kvf.pop();
+            } else if (op < 8 && reference.count(k) > 0) {
+                reference.pop(k);
+                kvf.pop(k);
+            } else if (op < 9 && reference.count(k) > 0) {
+                reference.move_to_back(k);
+                kvf.move_to_back(k);
+            } else if (reference.count(k) > 0) {
+                reference.last(k).second += "!";
+                kvf.last(k).second += "!";
+            }
+
+            // Kopie współdzielą bloki wartości, a zapisy trafiają tylko do własnych.
+            if (i % 2000 == 0) {
+                snapshots.push_back(kvf);
+                reference_snapshots.push_back(reference);
+            }
+
+            kvfifo<int, string> const &cref = reference;
+            slab_kvfifo<int, string> const &ckvf = kvf;
+            assert(ckvf.size() == cref.size() && ckvf.count(k) == cref.count(k));
+            if (!cref.empty()) {
+                assert(ckvf.front().second == cref.front().second && ckvf.back().second == cref.back().second);
+            }
+            if (cref.count(k) > 0) {
+                assert(ckvf.first(k).second == cref.first(k).second && ckvf.last(k).second == cref.last(k).second);
+            }
+        }
+
+        for (std::size_t s = 0; s < snapshots.size(); s++) {
+            assert(std::equal(snapshots[s].k_begin(), snapshots[s].k_end(),
+                              reference_snapshots[s].k_begin(), reference_snapshots[s].k_end()));
+            if (!snapshots[s].empty()) {
+                snapshots[s].front().second = "changed";
+                reference_snapshots[s].front().second = "changed";
+            }
+            while (!snapshots[s].empty()) {
+                assert(snapshots[s].front().second == reference_snapshots[s].front().second);
+                snapshots[s].pop();
+                reference_snapshots[s].pop();
+            }
+        }
+
+        // Zapasowy blok: kolejka z jednym elementem na zmianę nie alokuje nowych bloków.
+        slab_kvfifo<int, string> single;
+        single.push(1, "first");
+        string const *slot = &std::as_const(single).front().second;
+        for (int i = 0; i < 100; i++) {
+            single.pop();
+            single.push(i, std::to_string(i));
+            assert(&std::as_const(single).front().second == slot);
+        }
+        slab_kvfifo<int, string> single_copy = single;
+        single.pop();
+        single.push(2, "second");
+        assert(single_copy.front().second == "99" && single.front().second == "second");
+
+        // Po wydaniu referencji kopia od razu dostaje własne wartości.
+        slab_kvfifo<int, string> copy = kvf;
+        string &value = kvf.front().second;
+        slab_kvfifo<int, string> unshared = kvf;
+        value = "mine";
+        assert(unshared.front().second != "mine" && copy.front().second != "mine");
+        assert(copy.front().second == reference.front().second && kvf.front().second == "mine");
+
+        kvf.pop();
+        reference.pop();
+        copy.pop();
+        while (!kvf.empty()) {
+            assert(kvf.front().second == reference.front().second && copy.front().second == reference.front().second);
+            kvf.pop();
+            reference.pop();
+            copy.pop();
+        }
+        unshared.clear();
+        assert(copy.empty() && unshared.empty() && kvf.k_begin() == kvf.k_end());
+
+        try {
+            kvf.pop(1);
+            assert(false);
+        } catch (std::invalid_argument &e) {}
+
+        // Zdjęta wartość ginie razem z ostatnią kopią, która ją zawiera.
+        auto resource = std::make_shared<int>(1);
+        auto *first = new slab_kvfifo<int, std::shared_ptr<int>>();
+        first->push(1, resource);
+        first->push(2, resource);
+        slab_kvfifo<int, std::shared_ptr<int>> second = *first;
+        assert(resource.use_count() == 3);
+        second.pop();
+        assert(resource.use_count() == 3);
+        delete first;
+        assert(resource.use_count() == 2);
+        slab_kvfifo<int, std::shared_ptr<int>> third = second;
+        second.pop();
+        assert(resource.use_count() == 2);
+        third.clear();
+        assert(resource.use_count() == 1 && second.empty());
+    }
+
+    template<typename Q>
+    void memory_queue_test() {
+        Q kvf1;
+        assert(kvf1.memory_usage().total() == 0);
+        for (int i = 0; i < 100; i++) {
+            kvf1.push(i % 10, i);
+        }
+
+        kvfifo_memory_usage usage1 = kvf1.memory_usage();
+        assert(usage1.elements > 0 && usage1.key_lists > 0 && usage1.index > 0 && usage1.control_block > 0);
+        assert(usage1.exclusive == usage1.total() && usage1.shared == 0 && usage1.sharers == 1);
+
+        Q kvf2 = kvf1;
+        kvfifo_memory_usage usage2 = kvf2.memory_usage();
+        assert(usage2.total() == usage1.total() && usage2.shared == usage2.total() && usage2.sharers == 2);
+
+        kvf2.push(0, 100);
+        assert(kvf2.memory_usage().exclusive > usage1.total() && kvf1.memory_usage().exclusive == usage1.total());
+        kvf2.pop_all(0);
+        assert(kvf2.memory_usage().elements < usage1.elements);
+    }
+
+    void memory_test() {
+        cout << "Memory test" << endl;
+        using namespace kvfifo_policy;
+        memory_queue_test<kvfifo<int, int>>();
+        memory_queue_test<basic_kvfifo<int, int, hashed_index>>();
+        memory_queue_test<basic_kvfifo<int, int, sorted_vector_index>>();
+        memory_queue_test<basic_kvfifo<int, int, small_index<4>>>();
+        memory_queue_test<basic_kvfifo<int, int, dense_index<0, 9>>>();
+
+        kvfifo<int, int> kvf;
+        kvf.push(1, 1);
+        std::size_t before = kvf.memory_usage().index;
+        auto h = kvf.push_with_handle(1, 2);
+        assert(kvf.memory_usage().index > before);
+        kvf.erase(h);
+    }
+
+    void partition_test() {
+        cout << "Partition test" << endl;
+        kvfifo<int, int> kvf1;
+        for (int i = 0; i < 1000; i++) {
+            kvf1.push(i % 10, i);
+        }
+        kvfifo<int, int> const kvf1_copy = kvf1;
+
+        auto parts = kvf1.partition_by(3, [](int k) { return k % 3; });
+        assert(kvf1.empty() && kvf1_copy.size() == 1000 && parts.size() == 3);
+        assert(parts[0].size() == 400 && parts[1].size() == 300 && parts[2].size() == 300);
+        for (auto &part : parts) {
+            int previous = -1;
+            while (!part.empty()) {
+                assert(part.front().second > previous && part.front().first % 3 == (&part - &parts[0]));
+                previous = part.front().second;
+                part.pop();
+            }
+        }
+
+        // Niewspółdzielone dane są przepinane bez kopiowania.
+        kvfifo<int, int> kvf2;
+        kvf2.push(1, 1);
+        kvf2.push(2, 2);
+        kvf2.push(1, 3);
+        int &ref = kvf2.back().second;
+        auto [odd, even] = kvf2.split([](int k) { return k % 2 == 1; });
+        ref = 30;
+        assert(odd.size() == 2 && odd.last(1).second == 30 && even.front().second == 2);
+
+        // Numer spoza zakresu nie zmienia kolejki.
+        try {
+            odd.partition_by(1, [](int k) { return k; });
+            assert(false);
+        } catch (std::out_of_range &e) {}
+        assert(odd.size() == 2 && odd.count(1) == 2);
+
+        auto empty_parts = kvfifo<int, int>().partition_by(2, [](int) { return 0; });
+        assert(empty_parts.size() == 2 && empty_parts[0].empty());
+    }
+
+    void parallel_build_test() {
+        cout << "Parallel build test" << endl;
+        std::vector<std::pair<int, int>> items;
+        for (int i = 0; i < 100000; i++) {
+            items.push_back({i % 37, i});
+        }
+
+        auto kvf1 = kvfifo<int, int>::from_range(kvfifo_parallel{4}, items.begin(), items.end());
+        auto kvf2 = kvfifo<int, int>::from_range(items.begin(), items.end());
+        auto kvf3 = kvf1.clone(kvfifo_parallel{3});
+        kvfifo<int, int> const kvf4 = kvf1.clone(kvfifo_parallel{1});
+
+        for (auto *kvf : {&kvf1, &kvf2, &kvf3}) {
+            assert(kvf->size() == 100000 && kvf->count(36) == 2702);
+            assert(kvf->first(5).second == 5 && kvf->last(5).second == 99979);
+            for (int i = 0; i < 100000; i++) {
+                assert(kvf->front().first == i % 37 && kvf->front().second == i);
+                kvf->pop();
+            }
+        }
+        assert(kvf4.size() == 100000 && kvf4.back().second == 99999);
+
+        auto empty = kvfifo<int, int>::from_range(kvfifo_parallel{}, items.end(), items.end());
+        assert(empty.empty() && empty.clone(kvfifo_parallel{}).empty());
+    }
+
+    // Zasób liczący zaalokowane bajty; alokacje ponad limit zawodzą.
+    class counting_resource : public std::pmr::memory_resource {
+    public:
+        std::size_t in_use = 0;
+        std::size_t allocations = 0;
+        std::size_t deallocations = 0;
+
+    private:
+        void *do_allocate(std::size_t bytes, std::size_t align) override {
+            void *p = std::pmr::new_delete_resource()->allocate(bytes, align);
+            in_use += bytes;
+            allocations++;
+            return p;
+        }
+
+        void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+            in_use -= bytes;
+            deallocations++;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+        }
+
+        bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    template <typename Q>
+    void pmr_queue_test() {
+        counting_resource resource;
+        {
+            Q kvf1(&resource);
+            for (int i = 0; i < 100; i++) {
+                kvf1.push(i % 10, i);
+            }
+            assert(resource.in_use > 0 && kvf1.get_allocator().resource() == &resource);
+
+            // Kopia z tym samym zasobem współdzieli dane, a odłączając się, zostaje w zasobie.
+            Q kvf2(kvf1, &resource);
+            std::size_t shared = resource.in_use;
+            kvf2.pop(3);
+            assert(resource.in_use > shared && kvf1.count(3) == 10 && kvf2.count(3) == 9);
+
+            // Zwykła kopia dostaje zasób domyślny i od razu własne dane.
+            Q kvf3 = kvf1;
+            assert(kvf3.get_allocator().resource() == std::pmr::get_default_resource());
+            kvf3.move_to_back(0);
+            assert(kvf3.back().first == 0 && kvf1.back().first == 9);
+
+            // Przypisanie kopiuje prosto do zasobu celu, bez kopii w zasobie domyślnym.
+            counting_resource target, fallback;
+            std::pmr::memory_resource *old_default = std::pmr::set_default_resource(&fallback);
+            {
+                Q kvf4(&target);
+                kvf4 = kvf1;
+                assert(kvf4.size() == 100 && kvf4.get_allocator().resource() == &target && target.in_use > 0);
+                kvf4 = Q(kvf2, &resource);
+                assert(kvf4.count(3) == 9 && kvf4.get_allocator().resource() == &target);
+            }
+            std::pmr::set_default_resource(old_default);
+            assert(fallback.allocations == 0 && target.in_use == 0);
+
+            auto parts = kvf2.partition_by(2, [](int k) { return std::size_t(k % 2); });
+            assert(parts[0].get_allocator() == kvf1.get_allocator() && parts[1].size() == 49);
+            parts[1].append(std::move(kvf3));
+            parts[1].append(parts[0]);
+            assert(parts[1].size() == 199 && parts[1].front().second == 1);
+
+            kvf1.reserve(200, 10);
+            kvf1.erase_if([](int k, int v) { return k == 5 || v < 20; });
+            assert(kvf1.size() == 72 && kvf1.count(5) == 0);
+            kvf1.clear();
+            kvf1.shrink_to_fit();
+        }
+        assert(resource.in_use == 0);
+    }
+
+    void pmr_test() {
+        cout << "Pmr test" << endl;
+        using namespace kvfifo_policy;
+        pmr_queue_test<pmr_kvfifo<int, int>>();
+        pmr_queue_test<pmr_kvfifo<int, int, hashed_index>>();
+        pmr_queue_test<pmr_kvfifo<int, int, sorted_vector_index>>();
+        pmr_queue_test<pmr_kvfifo<int, int, small_index<4>>>();
+        pmr_queue_test<pmr_kvfifo<int, int, dense_index<0, 9>>>();
+
+        // Cała pamięć kolejki pochodzi z bufora - zasób nadrzędny nie pozwala alokować.
+        std::byte buffer[1 << 17];
+        std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+        pmr_kvfifo<int, int> kvf(&arena);
+        for (int i = 0; i < 500; i++) {
+            kvf.push(i % 7, i);
+        }
+        std::pmr::vector<std::pair<int, int>> items(&arena);
+        for (int i = 0; i < 100; i++) {
+            items.push_back({i % 3, i});
+        }
+        auto built = pmr_kvfifo<int, int>::from_range(kvfifo_parallel{4}, items.begin(), items.end(), &arena);
+        auto clone = kvf.clone(kvfifo_parallel{4});
+        kvf.prepare_detach();
+        assert(built.size() == 100 && built.count(2) == 33 && clone.size() == 500 && clone.count(6) == 71);
+        auto parts = clone.partition_by(3, [](int k) { return std::size_t(k % 3); });
+        assert(clone.empty() && parts[0].size() == 214 && parts[1].count(4) == 71 && parts[2].count(5) == 71);
+    }
+
+    void arena_test() {
+        cout << "Arena test" << endl;
+        using namespace kvfifo_policy;
+        pmr_queue_test<pmr_kvfifo<int, int, arena_storage>>();
+        pmr_queue_test<pmr_kvfifo<int, int, arena_storage, hashed_index>>();
+        pmr_queue_test<pmr_kvfifo<int, int, arena_storage, sorted_vector_index>>();
+        pmr_queue_test<pmr_kvfifo<int, int, arena_storage, small_index<4>>>();
+        pmr_queue_test<pmr_kvfifo<int, int, arena_storage, dense_index<0, 9>>>();
+
+        // clear() zwalnia kawałki areny, a nie pojedyncze węzły.
+        counting_resource resource;
+        {
+            pmr_kvfifo<int, int, arena_storage, hashed_index> kvf(&resource);
+            for (int i = 0; i < 100000; i++) {
+                kvf.push(i % 1000, i);
+            }
+            auto h = kvf.push_with_handle(7, -1);
+            std::size_t deallocations = resource.deallocations;
+            kvf.clear();
+            assert(resource.deallocations - deallocations < 100 && kvf.empty() && !kvf.valid(h));
+            for (int i = 0; i < 100; i++) {
+                kvf.push(i % 10, i);
+            }
+            assert(kvf.size() == 100 && kvf.count(3) == 10 && kvf.first(3).second == 3);
+        }
+        assert(resource.in_use == 0);
+
+        // Węzły wyrównane ponad wskaźnik też wracają na listy wolnych bloków.
+        struct alignas(16) wide {
+            int v;
+        };
+        {
+            pmr_kvfifo<int, wide, arena_storage> kvf(&resource);
+            pmr_kvfifo<int, long double, arena_storage> kvf2(&resource);
+            for (int i = 0; i < 100000; i++) {
+                kvf.push(i % 3, {i});
+                kvf2.push(i % 3, i);
+                assert(reinterpret_cast<std::uintptr_t>(&kvf.front().second) % 16 == 0);
+                kvf.pop();
+                kvf2.pop();
+            }
+            assert(resource.in_use < 32768 && kvf.empty() && kvf2.empty());
+        }
+        assert(resource.in_use == 0);
+
+        // Nietrywialne elementy są niszczone; kopie i części przeżywają oryginał.
+        basic_kvfifo<string, string, arena_storage> words;
+        for (int i = 0; i < 1000; i++) {
+            words.push(std::to_string(i % 50) + string(20, 'k'), std::to_string(i) + string(20, 'v'));
+        }
+        auto copy = words;
+        copy.move_to_back(string("0") + string(20, 'k'));
+        words.pop();
+        auto parts = words.partition_by(3, [](string const &k) { return k.size() % 3; });
+        words = copy;
+        copy.clear();
+        assert(words.size() == 1000 && copy.empty() && parts[0].size() + parts[1].size() + parts[2].size() == 999);
+        words.erase_if([](string const &, string const &v) { return v[0] == '1'; });
+        parts[0].append(std::move(words));
+        parts[1].clear();
+        assert(words.empty() && parts[1].empty() && parts[0].back().first == string("0") + string(20, 'k'));
+    }
+
+    // counting_resource pod muteksem - zwalnia do niego także wątek reclaimera.
+    class synchronized_counting_resource : public std::pmr::memory_resource {
+    public:
+        std::size_t in_use() const {
+            std::lock_guard<std::mutex> lock(mutex);
+            return counter.in_use;
+        }
+
+    private:
+        void *do_allocate(std::size_t bytes, std::size_t align) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            return counter.allocate(bytes, align);
+        }
+
+        void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+            std::lock_guard<std::mutex> lock(mutex);
+            counter.deallocate(p, bytes, align);
+        }
+
+        bool do_is_equal(std::pmr::memory_resource const &other) const noexcept override {
+            return this == &other;
+        }
+
+        mutable std::mutex mutex;
+        counting_resource counter;
+    };
+
+    // Własny reclaimer, żeby testy nie zależały od kvfifo_reclaimer::instance().
+    struct test_reclamation {
+        using category = kvfifo_policy::reclamation_tag;
+        static constexpr bool deferred = true;
+
+        static kvfifo_reclaimer &reclaimer() {
+            static kvfifo_reclaimer instance;
+            return instance;
+        }
+    };
+
+    void reclamation_test() {
+        cout << "Reclamation test" << endl;
+        using Q = pmr_kvfifo<int, int, test_reclamation>;
+        kvfifo_reclaimer &reclaimer = test_reclamation::reclaimer();
+        counting_resource resource;
+        {
+            Q kvf1(&resource);
+            for (int i = 0; i < 1000; i++) {
+                kvf1.push(i % 10, i);
+            }
+            Q kvf2(kvf1, &resource);
+            Q kvf3(kvf1, &resource);
+
+            // Odłączenie i operator= puszczają kontenery, które mają jeszcze innych właścicieli.
+            kvf2.pop();
+            kvf3 = Q(kvf2, &resource);
+            assert(reclaimer.pending() == 0);
+
+            // Ostatni właściciel tylko oddaje kontener.
+            kvf1 = Q(&resource);
+            assert(reclaimer.pending() == 1 && kvf1.empty() && kvf2.size() == 999);
+            std::size_t in_use = resource.in_use;
+            assert(reclaimer.collect() == 1 && resource.in_use < in_use && reclaimer.pending() == 0);
+
+            kvf2.clear();
+            assert(reclaimer.pending() == 0 && kvf3.size() == 999);
+            kvf3.clear();
+            kvf2.push(1, 1);
+            assert(reclaimer.pending() == 1 && kvf2.size() == 1);
+        }
+        assert(reclaimer.pending() == 2 && resource.in_use > 0);
+        assert(reclaimer.collect() == 2 && resource.in_use == 0);
+
+        // Wątek reclaimera niszczy kontenery na bieżąco; stop() czeka na oddane wcześniej.
+        synchronized_counting_resource shared_resource;
+        reclaimer.start();
+        for (int r = 0; r < 10; r++) {
+            Q kvf(&shared_resource);
+            for (int i = 0; i < 1000; i++) {
+                kvf.push(i % 7, i);
+            }
+            auto parts = kvf.partition_by(3, [](int k) { return std::size_t(k % 3); });
+            parts[0].append(std::move(parts[1]));
+        }
+        reclaimer.stop();
+        assert(reclaimer.pending() == 0 && shared_resource.in_use() == 0);
+
+        basic_kvfifo<int, int, kvfifo_policy::deferred_reclamation> shared;
+        shared.push(1, 2);
+        shared.clear();
+        assert(kvfifo_reclaimer::instance().collect() >= 1);
+    }
+
     void mkostyk_kvfifo_test_main() {
         cout << "\033[1;37m" << "---------- MKOSTYK TEST ----------" << "\033[0m" << endl;
         peczar_test();
@@ -273,6 +1581,26 @@ namespace mkostyk {
         shared_data_test();
         //very_long_key_test();
         invalidating_references_test();
+        modify_test();
+        prepare_detach_test();
+        transaction_test();
+        policy_test();
+        static_kvfifo_test();
+        append_test();
+        partition_test();
+        parallel_build_test();
+        erase_test();
+        handle_test();
+        async_test();
+        blocking_test();
+        fair_test();
+        epoch_test();
+        flat_test();
+        slab_test();
+        memory_test();
+        pmr_test();
+        arena_test();
+        reclamation_test();
     }
 } // namespace mkostyk
 #endif // KVFIFO_TEST_H_
\ No newline at end of file
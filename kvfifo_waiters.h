@@ -0,0 +1,94 @@
+#ifndef KVFIFO_WAITERS_H
+#define KVFIFO_WAITERS_H
+
+#include "kvfifo.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+
+namespace kvfifo_detail {
+    /**
+     * Konsumenci czekający na elementy kolejki: czekający na dowolny element
+     * na jednej liście, czekający na klucz na liście tego klucza (indeks
+     * według polityki indeksu kolejki). Waiter musi mieć pola key
+     * (std::optional<K>), seq, position i registered - ustawia je rejestr.
+     */
+    template<typename K, typename Waiter, typename... Policies>
+    class waiter_registry {
+    public:
+        using list_type = std::list<Waiter *>;
+
+        void enlist(Waiter *waiter) {
+            list_type *list = &any_waiters;
+
+            if (waiter->key.has_value()) {
+                auto it = key_waiters.find(*waiter->key);
+
+                if (it == key_waiters.end()) {
+                    it = key_waiters.insert({*waiter->key, list_type()}).first;
+                }
+
+                list = &it->second;
+            }
+
+            try {
+                waiter->position = list->insert(list->end(), waiter);
+            } catch (...) {
+                if (waiter->key.has_value() && list->empty()) {
+                    key_waiters.erase(key_waiters.find(*waiter->key));
+                }
+
+                throw;
+            }
+
+            waiter->seq = next_seq++;
+            waiter->registered = true;
+            waiters++;
+        }
+
+        void unregister(Waiter *waiter) noexcept {
+            if (!waiter->key.has_value()) {
+                any_waiters.erase(waiter->position);
+            } else {
+                auto it = key_waiters.find(*waiter->key);
+                it->second.erase(waiter->position);
+
+                if (it->second.empty()) {
+                    key_waiters.erase(it);
+                }
+            }
+
+            waiter->registered = false;
+            waiters--;
+        }
+
+        // Najdłużej czekający konsument, któremu pasuje element o kluczu k.
+        Waiter *first(K const &k) {
+            Waiter *any = any_waiters.empty() ? nullptr : any_waiters.front();
+            auto it = key_waiters.find(k);
+
+            if (it == key_waiters.end()) {
+                return any;
+            }
+
+            Waiter *keyed = it->second.front();
+            return any != nullptr && any->seq < keyed->seq ? any : keyed;
+        }
+
+        std::size_t size() const noexcept {
+            return waiters;
+        }
+
+    private:
+        using map_type = typename select_policy<
+            kvfifo_policy::index_tag, kvfifo_policy::ordered_index, Policies...>::type
+            ::template map_type<K, list_type>;
+
+        list_type any_waiters;
+        map_type key_waiters;
+        std::uint64_t next_seq = 0;
+        std::size_t waiters = 0;
+    };
+} // namespace kvfifo_detail
+
+#endif
@@ -0,0 +1,406 @@
+#ifndef SLAB_KVFIFO_H
+#define SLAB_KVFIFO_H
+
+#include "kvfifo.h"
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+ * Kolejka basic_kvfifo dla dużych wartości: węzły kolejki trzymają tylko
+ * klucz i numer miejsca wartości, a same wartości leżą w blokach po
+ * block_values miejsc. Przechodzenie po kolejce (pop(), move_to_back(),
+ * odłączenie kopii) nie dotyka wtedy bajtów wartości. Kopie kolejki
+ * współdzielą bloki: wartości nie są kopiowane przy kopiowaniu ani przy
+ * odłączaniu węzłów, a blok jest kopiowany dopiero wtedy, gdy kolejka chce
+ * w nim coś zapisać, a ktoś inny też go używa. Zapisujemy tylko do bloków,
+ * które mamy na wyłączność, więc współdzielone wartości się nie zmieniają.
+ * Każde miejsce liczy kopie, które je zawierają; wartość niszczy ta, która
+ * zdejmuje ją lub ginie jako ostatnia, więc zasoby zdjętej wartości
+ * zwalniamy, gdy żadna kopia jej już nie zawiera. Jeden pusty własny blok
+ * zostaje w zapasie, więc kolejka, która na przemian dostaje i oddaje
+ * element, nie alokuje bloków.
+ */
+template<typename K, typename V, typename... Policies>
+class slab_kvfifo {
+    using slot_t = std::uint32_t;
+
+public:
+    static constexpr std::size_t block_values = 16;
+
+    using queue_type = basic_kvfifo<K, slot_t, Policies...>;
+    using k_iterator = typename queue_type::k_iterator;
+
+    slab_kvfifo() = default;
+
+    slab_kvfifo(slab_kvfifo const &other)
+        : queue(other.queue), blocks(other.blocks), free_blocks(other.free_blocks), empty_blocks(other.empty_blocks) {
+        // Zapasowy blok zostaje w other - wspólny nie nadawałby się do zapisu.
+        if (other.spare != npos_block && blocks[other.spare].block != nullptr && blocks[other.spare].live == 0) {
+            blocks[other.spare].block.reset();
+            empty_blocks.push_back(other.spare);
+        }
+
+        // Wartości, do których ktoś ma referencje, nie mogą być wspólne.
+        if (other.unshareable) {
+            for (auto &ref : blocks) {
+                if (ref.block != nullptr) {
+                    ref.replace(clone(ref));
+                }
+            }
+        }
+    }
+
+    slab_kvfifo(slab_kvfifo &&other) noexcept {
+        swap(other);
+    }
+
+    slab_kvfifo &operator=(slab_kvfifo other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    void push(K const &k, V const &v) {
+        slot_t slot = writable_slot();
+        block_ref_t &ref = blocks[slot / block_values];
+        std::uint64_t bit = bit_of(slot);
+
+        ref.block->construct(slot % block_values, v);
+
+        try {
+            queue.push(k, slot);
+        } catch (...) {
+            ref.block->release(slot % block_values);
+            throw;
+        }
+
+        ref.live |= bit;
+        unshareable = false;
+    }
+
+    void pop() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        slot_t slot = cqueue().front().second;
+        prepare_release();
+        queue.pop();
+        release(slot);
+    }
+
+    void pop(K const &k) {
+        slot_t slot = cqueue().first(k).second;
+        prepare_release();
+        queue.pop(k);
+        release(slot);
+    }
+
+    // Przepina tylko małe węzły kolejki; wartości zostają na miejscu.
+    void move_to_back(K const &k) {
+        queue.move_to_back(k);
+        unshareable = false;
+    }
+
+    std::pair<K const &, V const &> front() const {
+        auto elem = cqueue().front();
+        return {elem.first, value(elem.second)};
+    }
+
+    // Zwrócona referencja do wartości sprawia, że kopie nie współdzielą danych.
+    std::pair<K const &, V &> front() {
+        auto elem = cqueue().front();
+        return {elem.first, writable_value(elem.second)};
+    }
+
+    std::pair<K const &, V const &> back() const {
+        auto elem = cqueue().back();
+        return {elem.first, value(elem.second)};
+    }
+
+    std::pair<K const &, V &> back() {
+        auto elem = cqueue().back();
+        return {elem.first, writable_value(elem.second)};
+    }
+
+    std::pair<K const &, V const &> first(K const &key) const {
+        auto elem = cqueue().first(key);
+        return {elem.first, value(elem.second)};
+    }
+
+    std::pair<K const &, V &> first(K const &key) {
+        auto elem = cqueue().first(key);
+        return {elem.first, writable_value(elem.second)};
+    }
+
+    std::pair<K const &, V const &> last(K const &key) const {
+        auto elem = cqueue().last(key);
+        return {elem.first, value(elem.second)};
+    }
+
+    std::pair<K const &, V &> last(K const &key) {
+        auto elem = cqueue().last(key);
+        return {elem.first, writable_value(elem.second)};
+    }
+
+    std::size_t size() const noexcept {
+        return queue.size();
+    }
+
+    bool empty() const noexcept {
+        return queue.empty();
+    }
+
+    std::size_t count(K const &k) const {
+        return queue.count(k);
+    }
+
+    void clear() noexcept {
+        queue.clear();
+        blocks.clear();
+        free_blocks.clear();
+        empty_blocks.clear();
+        spare = npos_block;
+        unshareable = false;
+    }
+
+    void swap(slab_kvfifo &other) noexcept {
+        queue.swap(other.queue);
+        std::swap(blocks, other.blocks);
+        std::swap(free_blocks, other.free_blocks);
+        std::swap(empty_blocks, other.empty_blocks);
+        std::swap(spare, other.spare);
+        std::swap(unshareable, other.unshareable);
+    }
+
+    k_iterator k_begin() const {
+        return queue.k_begin();
+    }
+
+    k_iterator k_end() const {
+        return queue.k_end();
+    }
+
+private:
+    /**
+     * Miejsca na block_values wartości; holders[i] - ile kopii kolejki
+     * zawiera wartość z miejsca i. Wartość istnieje, dopóki holders[i] > 0,
+     * więc blok trafia do destruktora już bez wartości.
+     */
+    struct block_t {
+        block_t() = default;
+
+        block_t(block_t const &) = delete;
+        block_t &operator=(block_t const &) = delete;
+
+        V &get(std::size_t i) noexcept {
+            return *std::launder(reinterpret_cast<V *>(storage + i * sizeof(V)));
+        }
+
+        // Tylko w wolnym miejscu bloku, który mamy na wyłączność.
+        void construct(std::size_t i, V const &v) {
+            ::new (storage + i * sizeof(V)) V(v);
+            holders[i].store(1, std::memory_order_relaxed);
+        }
+
+        void hold(std::size_t i) noexcept {
+            holders[i].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // acq_rel: odczyty wartości w innych kopiach kończą się przed jej zniszczeniem.
+        void release(std::size_t i) noexcept {
+            if (holders[i].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                get(i).~V();
+            }
+        }
+
+        alignas(V) std::byte storage[block_values * sizeof(V)];
+        std::atomic<std::uint32_t> holders[block_values] = {};
+    };
+
+    /**
+     * Blok widziany przez tę kolejkę; live - miejsca, do których odwołują się
+     * jej węzły (każde liczy się w holders bloku), listed - czy numer bloku
+     * jest w free_blocks.
+     */
+    struct block_ref_t {
+        block_ref_t() = default;
+
+        explicit block_ref_t(std::shared_ptr<block_t> block) noexcept : block(std::move(block)) {}
+
+        block_ref_t(block_ref_t const &other) noexcept
+            : block(other.block), live(other.live), listed(other.listed) {
+            for (std::uint64_t bits = live; bits != 0; bits &= bits - 1) {
+                block->hold(std::countr_zero(bits));
+            }
+        }
+
+        block_ref_t(block_ref_t &&other) noexcept
+            : block(std::move(other.block)), live(std::exchange(other.live, 0)), listed(other.listed) {}
+
+        block_ref_t &operator=(block_ref_t const &) = delete;
+
+        ~block_ref_t() noexcept {
+            release_live();
+        }
+
+        // Przechodzi na copy, które ma już własne egzemplarze wartości z live.
+        void replace(std::shared_ptr<block_t> copy) noexcept {
+            release_live();
+            block = std::move(copy);
+        }
+
+        std::shared_ptr<block_t> block;
+        std::uint64_t live = 0;
+        bool listed = false;
+
+    private:
+        void release_live() noexcept {
+            for (std::uint64_t bits = live; bits != 0; bits &= bits - 1) {
+                block->release(std::countr_zero(bits));
+            }
+        }
+    };
+
+    static constexpr std::size_t npos_block = std::numeric_limits<std::size_t>::max();
+    static constexpr std::uint64_t all_slots = (std::uint64_t(1) << block_values) - 1;
+
+    static std::uint64_t bit_of(slot_t slot) noexcept {
+        return std::uint64_t(1) << (slot % block_values);
+    }
+
+    queue_type const &cqueue() const noexcept {
+        return queue;
+    }
+
+    V const &value(slot_t slot) const noexcept {
+        return blocks[slot / block_values].block->get(slot % block_values);
+    }
+
+    // Kopia bloku z wartościami, których używa ta kolejka.
+    static std::shared_ptr<block_t> clone(block_ref_t const &ref) {
+        auto copy = std::make_shared<block_t>();
+
+        for (std::uint64_t bits = ref.live; bits != 0; bits &= bits - 1) {
+            int i = std::countr_zero(bits);
+            copy->construct(i, ref.block->get(i));
+        }
+
+        return copy;
+    }
+
+    V &writable_value(slot_t slot) {
+        block_ref_t &ref = blocks[slot / block_values];
+
+        if (!kvfifo_detail::exclusive(ref.block, 1)) {
+            ref.replace(clone(ref));
+        }
+
+        unshareable = true;
+        return ref.block->get(slot % block_values);
+    }
+
+    /**
+     * Wolne miejsce w bloku, który mamy na wyłączność: inne kopie już go nie
+     * mają, więc miejsca spoza live są puste. Bloki wspólne, porzucone
+     * i pełne po drodze wypisujemy z free_blocks.
+     */
+    slot_t writable_slot() {
+        while (!free_blocks.empty()) {
+            std::size_t index = free_blocks.back();
+            block_ref_t &ref = blocks[index];
+
+            if (ref.block != nullptr && ref.live != all_slots && kvfifo_detail::exclusive(ref.block, 1)) {
+                return static_cast<slot_t>(index * block_values + std::countr_one(ref.live));
+            }
+
+            ref.listed = false;
+            free_blocks.pop_back();
+        }
+
+        std::size_t index = empty_blocks.empty() ? blocks.size() : empty_blocks.back();
+
+        if (index * block_values > std::numeric_limits<slot_t>::max() - block_values) {
+            throw std::length_error("slab_kvfifo too large");
+        }
+
+        free_blocks.reserve(blocks.size() + 1);
+        blocks.reserve(blocks.size() + 1);
+        auto block = std::make_shared<block_t>();
+
+        if (index == blocks.size()) {
+            blocks.emplace_back(std::move(block));
+        } else {
+            blocks[index].block = std::move(block);
+            empty_blocks.pop_back();
+        }
+
+        list(index);
+        return static_cast<slot_t>(index * block_values);
+    }
+
+    // Dopisuje blok do free_blocks, jeśli go tam nie ma; miejsce musi być zarezerwowane.
+    void list(std::size_t index) noexcept {
+        if (!blocks[index].listed) {
+            blocks[index].listed = true;
+            free_blocks.push_back(index);
+        }
+    }
+
+    // Czy mamy zapasowy blok inny niż index: własny i bez naszych wartości.
+    bool has_spare(std::size_t index) const noexcept {
+        return spare != npos_block && spare != index && blocks[spare].block != nullptr &&
+               blocks[spare].live == 0 && kvfifo_detail::exclusive(blocks[spare].block, 1);
+    }
+
+    // Po tym release() już nie alokuje - każdy blok jest w free_blocks najwyżej raz.
+    void prepare_release() {
+        free_blocks.reserve(blocks.size());
+        empty_blocks.reserve(blocks.size());
+    }
+
+    /**
+     * Zwalnia miejsce zdjętego elementu. Wartość niszczy ostatnia kopia,
+     * która ją zawiera - my albo inna. Blok bez naszych wartości porzucamy,
+     * chyba że jest własny i nie mamy jeszcze zapasowego.
+     */
+    void release(slot_t slot) noexcept {
+        std::size_t index = slot / block_values;
+        block_ref_t &ref = blocks[index];
+        ref.live &= ~bit_of(slot);
+        ref.block->release(slot % block_values);
+        bool owned = kvfifo_detail::exclusive(ref.block, 1);
+
+        if (owned) {
+            list(index);
+        }
+
+        if (ref.live == 0) {
+            if (owned && !has_spare(index)) {
+                spare = index;
+            } else {
+                ref.block.reset();
+                empty_blocks.push_back(index);
+            }
+        }
+
+        unshareable = false;
+    }
+
+    queue_type queue;
+    std::vector<block_ref_t> blocks;
+    // Numery bloków, w których mogą być wolne miejsca, każdy najwyżej raz.
+    std::vector<std::size_t> free_blocks;
+    std::vector<std::size_t> empty_blocks;
+    std::size_t spare = npos_block;
+    bool unshareable = false;
+};
+
+#endif
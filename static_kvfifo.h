@@ -0,0 +1,396 @@
+#ifndef STATIC_KVFIFO_H
+#define STATIC_KVFIFO_H
+
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Kolejka o tym samym interfejsie co kvfifo, ale o stałej pojemności:
+ * co najwyżej N elementów i MaxKeys różnych kluczy. Elementy i indeks kluczy
+ * są trzymane w tablicach wewnątrz obiektu, więc żadna operacja nie alokuje
+ * pamięci, a kopia jest zwykłą kopią tablic (bez współdzielenia). K i V muszą
+ * mieć konstruktory domyślne i przypisania, a przypisania przenoszące nie
+ * mogą zgłaszać wyjątków. Usunięte elementy są zastępowane domyślnymi K i V,
+ * więc ich zasoby są zwalniane od razu, jak w kvfifo.
+ */
+template<typename K, typename V, std::size_t N, std::size_t MaxKeys = N>
+class static_kvfifo {
+    static_assert(N > 0 && MaxKeys > 0, "static_kvfifo needs a non-zero capacity");
+    static_assert(std::is_default_constructible_v<K> && std::is_default_constructible_v<V>,
+                  "static_kvfifo stores K and V in arrays");
+    static_assert(std::is_nothrow_move_assignable_v<K> && std::is_nothrow_move_assignable_v<V>,
+                  "static_kvfifo shifts keys and releases slots by move assignment");
+
+private:
+    using index_t = std::size_t;
+    static constexpr index_t npos = N;
+
+    struct node_t {
+        K key{};
+        V value{};
+        index_t prev = npos;
+        index_t next = npos;
+        index_t next_same_key = npos;
+    };
+
+    struct key_entry_t {
+        K key{};
+        index_t head = npos;
+        index_t tail = npos;
+        std::size_t count = 0;
+    };
+
+public:
+    constexpr static_kvfifo() noexcept(std::is_nothrow_default_constructible_v<K> &&
+                                       std::is_nothrow_default_constructible_v<V>) {
+        for (index_t i = 0; i < N; i++) {
+            nodes[i].next = i + 1;
+        }
+    }
+
+    /**
+     * Zwraca false, jeśli zabrakło miejsca na element lub na nowy klucz;
+     * kolejka pozostaje wtedy bez zmian.
+     */
+    [[nodiscard]] constexpr bool push(K const &k, V const &v) {
+        if (free_head == npos) {
+            return false;
+        }
+
+        std::size_t pos = lower_bound(k);
+        bool new_key = pos == key_count || k < keys[pos].key;
+
+        if (new_key && key_count == MaxKeys) {
+            return false;
+        }
+
+        index_t id = free_head;
+        nodes[id].key = k;
+        nodes[id].value = v;
+
+        if (new_key) {
+            K key_copy = k;
+
+            for (std::size_t i = key_count; i > pos; i--) {
+                keys[i] = std::move(keys[i - 1]);
+            }
+
+            keys[pos] = key_entry_t{std::move(key_copy), npos, npos, 0};
+            key_count++;
+        }
+
+        free_head = nodes[id].next;
+        link_back(id);
+
+        key_entry_t &entry = keys[pos];
+        nodes[id].next_same_key = npos;
+
+        if (entry.tail == npos) {
+            entry.head = id;
+        } else {
+            nodes[entry.tail].next_same_key = id;
+        }
+
+        entry.tail = id;
+        entry.count++;
+        elements++;
+
+        return true;
+    }
+
+    constexpr void pop() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        remove_first_of(find_key(nodes[head].key));
+    }
+
+    constexpr void pop(K const &k) {
+        std::size_t pos = find_key(k);
+
+        if (pos == key_count) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        remove_first_of(pos);
+    }
+
+    constexpr void move_to_back(K const &k) {
+        std::size_t pos = find_key(k);
+
+        if (pos == key_count) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        for (index_t id = keys[pos].head; id != npos; id = nodes[id].next_same_key) {
+            unlink(id);
+            link_back(id);
+        }
+    }
+
+    constexpr std::pair<K const &, V const &> front() const {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        return {nodes[head].key, nodes[head].value};
+    }
+
+    constexpr std::pair<K const &, V &> front() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        return {nodes[head].key, nodes[head].value};
+    }
+
+    constexpr std::pair<K const &, V const &> back() const {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        return {nodes[tail].key, nodes[tail].value};
+    }
+
+    constexpr std::pair<K const &, V &> back() {
+        if (empty()) {
+            throw std::invalid_argument("Empty queue");
+        }
+
+        return {nodes[tail].key, nodes[tail].value};
+    }
+
+    constexpr std::pair<K const &, V const &> first(K const &key) const {
+        index_t id = keys[existing_key(key)].head;
+        return {nodes[id].key, nodes[id].value};
+    }
+
+    constexpr std::pair<K const &, V &> first(K const &key) {
+        index_t id = keys[existing_key(key)].head;
+        return {nodes[id].key, nodes[id].value};
+    }
+
+    constexpr std::pair<K const &, V const &> last(K const &key) const {
+        index_t id = keys[existing_key(key)].tail;
+        return {nodes[id].key, nodes[id].value};
+    }
+
+    constexpr std::pair<K const &, V &> last(K const &key) {
+        index_t id = keys[existing_key(key)].tail;
+        return {nodes[id].key, nodes[id].value};
+    }
+
+    constexpr std::size_t size() const noexcept {
+        return elements;
+    }
+
+    constexpr bool empty() const noexcept {
+        return elements == 0;
+    }
+
+    static constexpr std::size_t capacity() noexcept {
+        return N;
+    }
+
+    constexpr std::size_t count(K const &k) const {
+        std::size_t pos = find_key(k);
+        return pos == key_count ? 0 : keys[pos].count;
+    }
+
+    /**
+     * Zwolnione miejsca dostają domyślne K i V dopiero po opróżnieniu
+     * kolejki, więc wyjątek z ich konstruktora zostawia ją pustą.
+     */
+    constexpr void clear() noexcept(std::is_nothrow_default_constructible_v<K> &&
+                                    std::is_nothrow_default_constructible_v<V>) {
+        index_t const old_free = free_head;
+
+        while (head != npos) {
+            index_t next = nodes[head].next;
+            nodes[head].next = free_head;
+            free_head = head;
+            head = next;
+        }
+
+        tail = npos;
+        std::size_t const released_keys = std::exchange(key_count, 0);
+        elements = 0;
+
+        for (index_t id = free_head; id != old_free; id = nodes[id].next) {
+            nodes[id].key = K{};
+            nodes[id].value = V{};
+        }
+
+        for (std::size_t i = 0; i < released_keys; i++) {
+            keys[i].key = K{};
+        }
+    }
+
+    class k_iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = const K;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const K *;
+        using reference = const K &;
+
+        constexpr k_iterator() = default;
+
+        constexpr explicit k_iterator(key_entry_t const *it) : it(it) {}
+
+        constexpr K const &operator*() const {
+            return it->key;
+        }
+
+        constexpr K const *operator->() const {
+            return &it->key;
+        }
+
+        constexpr k_iterator &operator++() {
+            ++it;
+            return *this;
+        }
+
+        constexpr k_iterator operator++(int) {
+            k_iterator tmp(*this);
+            operator++();
+            return tmp;
+        }
+
+        constexpr k_iterator &operator--() {
+            --it;
+            return *this;
+        }
+
+        constexpr k_iterator operator--(int) {
+            k_iterator tmp(*this);
+            operator--();
+            return tmp;
+        }
+
+        constexpr bool operator==(k_iterator const &other) const {
+            return it == other.it;
+        }
+
+        constexpr bool operator!=(k_iterator const &other) const {
+            return it != other.it;
+        }
+
+    private:
+        key_entry_t const *it = nullptr;
+    };
+
+    constexpr k_iterator k_begin() const {
+        return k_iterator(keys.data());
+    }
+
+    constexpr k_iterator k_end() const {
+        return k_iterator(keys.data() + key_count);
+    }
+
+private:
+    constexpr std::size_t lower_bound(K const &k) const {
+        std::size_t lo = 0, hi = key_count;
+
+        while (lo < hi) {
+            std::size_t mid = lo + (hi - lo) / 2;
+
+            if (keys[mid].key < k) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        return lo;
+    }
+
+    // Pozycja klucza w tablicy kluczy albo key_count, jeśli go nie ma.
+    constexpr std::size_t find_key(K const &k) const {
+        std::size_t pos = lower_bound(k);
+        return pos != key_count && !(k < keys[pos].key) ? pos : key_count;
+    }
+
+    constexpr std::size_t existing_key(K const &k) const {
+        std::size_t pos = find_key(k);
+
+        if (pos == key_count) {
+            throw std::invalid_argument("Key not found");
+        }
+
+        return pos;
+    }
+
+    constexpr void link_back(index_t id) noexcept {
+        nodes[id].prev = tail;
+        nodes[id].next = npos;
+
+        if (tail == npos) {
+            head = id;
+        } else {
+            nodes[tail].next = id;
+        }
+
+        tail = id;
+    }
+
+    constexpr void unlink(index_t id) noexcept {
+        if (nodes[id].prev == npos) {
+            head = nodes[id].next;
+        } else {
+            nodes[nodes[id].prev].next = nodes[id].next;
+        }
+
+        if (nodes[id].next == npos) {
+            tail = nodes[id].prev;
+        } else {
+            nodes[nodes[id].next].prev = nodes[id].prev;
+        }
+    }
+
+    /**
+     * Usuwa najstarszy element klucza z pozycji pos w tablicy kluczy.
+     * Domyślne obiekty dla zwolnionych miejsc tworzymy przed zmianami -
+     * dalej nic nie zgłasza wyjątków.
+     */
+    constexpr void remove_first_of(std::size_t pos) {
+        node_t blank{};
+        key_entry_t blank_entry{};
+        key_entry_t &entry = keys[pos];
+        index_t id = entry.head;
+
+        entry.head = nodes[id].next_same_key;
+        entry.count--;
+
+        unlink(id);
+        nodes[id].key = std::move(blank.key);
+        nodes[id].value = std::move(blank.value);
+        nodes[id].next = free_head;
+        free_head = id;
+        elements--;
+
+        if (entry.count == 0) {
+            for (std::size_t i = pos; i + 1 < key_count; i++) {
+                keys[i] = std::move(keys[i + 1]);
+            }
+
+            key_count--;
+            keys[key_count] = std::move(blank_entry);
+        }
+    }
+
+    std::array<node_t, N> nodes{};
+    std::array<key_entry_t, MaxKeys> keys{};
+    index_t head = npos;
+    index_t tail = npos;
+    index_t free_head = 0;
+    std::size_t key_count = 0;
+    std::size_t elements = 0;
+};
+
+#endif